@@ -4,10 +4,16 @@
 #include <map>
 #include <set>
 #include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
 
 #include "settype.hh"
 #include "pixel.hh" // For pixelmethod
 #include "openmp.hh"
+#include "arena.hh"
+#include "fft.hh"
 
 unsigned x_divide_input = 1;
 unsigned y_divide_input = 1;
@@ -16,6 +22,16 @@ unsigned x_divide_reference = 32;
 unsigned y_divide_reference = 32;
 
 bool always_align_with_canvas = false;
+bool use_phase_correlation = false;
+bool wide_hotspot_search = false;
+
+/* Above this many offsets, the hotspot Align() lists
+ * its votes rather than marking them in a bitmap.
+ */
+static const unsigned long long MaxDenseVoteGrid = 1ull << 24;
+
+/* Motion limit of the hotspot Align() when not limited to mv range */
+static const int AnyMotion = 0x3FFFFFFF;
 
 int mv_xmin = -9999;
 int mv_ymin = -9999;
@@ -60,14 +76,257 @@ namespace
     };
 }
 
-static inline unsigned char GetLuma(uint32 pix)
+namespace
+{
+    /* Gets the luma, in 0..255 range, of count pixels. Transparent
+     * pixels are converted too; their value is simply never used.
+     */
+    void GetLumaRow(unsigned char*__restrict target,
+                    const uint32*__restrict input,
+                    unsigned count) VectorizedKernel;
+    void GetLumaRow(unsigned char*__restrict target,
+                    const uint32*__restrict input,
+                    unsigned count)
+    {
+        for(unsigned a=0; a<count; ++a)
+        {
+            uint32 pix = input[a];
+            unsigned r = (pix >> 16) & 0xFF, g = (pix >> 8) & 0xFF, b = pix & 0xFF;
+            target[a] = (r*RY + g*GY + b*BY + RGB2YUV_MUL/2) / RGB2YUV_MUL;
+        }
+    }
+
+    /* A bitmap with one bit per pixel, 64 pixels per word */
+    inline unsigned BitmapWordsPerRow(unsigned sx) { return (sx + 63) / 64; }
+    inline bool TestBit(const uint64* row, unsigned x)
+    {
+        return (row[x / 64] >> (x % 64)) & 1;
+    }
+
+    /* Sets the bit of each pixel whose 4x4 block (extending right
+     * and down from it) contains a transparent pixel. Spots are
+     * calculated from 4x4 squares, so a single transparent pixel
+     * affects the spots of the 4x4 section up and left of it.
+     */
+    void GetTransparencyBitmap(uint64* target,
+                               const uint32* input,
+                               unsigned sx, unsigned sy)
+    {
+        const unsigned words = BitmapWordsPerRow(sx);
+
+        /* First, mark the transparent pixels and widen
+         * each mark by three pixels towards the left.
+         */
+        for(unsigned y=0; y<sy; ++y)
+        {
+            uint64* row = target + y*words;
+            const uint32* src = input + y*sx;
+            for(unsigned w=0; w<words; ++w)
+            {
+                unsigned n = sx - w*64; if(n > 64) n = 64;
+                uint64 bits = 0;
+                for(unsigned b=0; b<n; ++b)
+                    bits |= uint64(src[w*64+b] >> 24 != 0) << b;
+                row[w] = bits;
+            }
+            for(unsigned w=0; w<words; ++w)
+            {
+                uint64 here = row[w], next = w+1 < words ? row[w+1] : 0;
+                row[w] = here | (here >> 1) | (here >> 2) | (here >> 3)
+                       | (next << 63) | (next << 62) | (next << 61);
+            }
+        }
+        /* Then widen them by three rows upwards. */
+        for(unsigned y=0; y<sy; ++y)
+        {
+            uint64* row = target + y*words;
+            for(unsigned yo=1; yo<4 && y+yo<sy; ++yo)
+                for(unsigned w=0; w<words; ++w)
+                    row[w] |= row[w + yo*words];
+        }
+    }
+
+    /* The 4x4 block of Y (brightness) values at p, verbatim
+     * in 16 bytes (two 8-byte integers).
+     */
+    inline SpotType GetSpot(const unsigned char* Y, unsigned p, unsigned sx)
+    {
+        uint32 pix[4] = { *(const uint32*)&Y[p     ],
+                          *(const uint32*)&Y[p+sx  ],
+                          *(const uint32*)&Y[p+sx*2],
+                          *(const uint32*)&Y[p+sx*3] };
+        return SpotType( pix[0] | (uint64(pix[1]) << 32),
+                         pix[2] | (uint64(pix[3]) << 32) );
+    }
+
+    inline unsigned HashSpot(const SpotType& spot)
+    {
+        uint64 h = (spot.first ^ (spot.second * 0x9E3779B97F4A7C15ull))
+                 * 0xBF58476D1CE4E5B9ull;
+        return h >> 32;
+    }
+
+    struct RarityCount
+    {
+        SpotType spot;
+        unsigned count; // 0 = unused slot
+        unsigned first; // Coordinate of the first occurrence
+    };
+
+    /* From each cell cx1..cx2-1, cy1..cy2-1 of a picture divided
+     * into cells of x_divide x y_divide pixels, pick the SpotType
+     * that occurs the least number of times (the smallest such
+     * SpotType if there are several), and the first coordinate
+     * where it occurs. Transparent spots count as SpotType().
+     * The occurrences are counted in a small open-addressing
+     * hash table, one cell at a time.
+     * Y and Transparent need to be valid for the rows of those
+     * cells and the three rows below them.
+     * The result of cell n goes into winners[n] (a pixel index,
+     * ~0u if the cell has no spots) and winner_spots[n].
+     */
+    void FindRarestSpots(unsigned* winners, SpotType* winner_spots,
+                         const unsigned char* Y, const uint64* Transparent,
+                         unsigned sx, unsigned sy,
+                         unsigned x_divide, unsigned y_divide,
+                         unsigned cx1, unsigned cx2,
+                         unsigned cy1, unsigned cy2)
+    {
+        const unsigned words    = BitmapWordsPerRow(sx);
+        const unsigned x_shrunk = (sx + x_divide-1) / x_divide;
+        const unsigned x_limit  = sx >= 4 ? sx-3 : 0; // Spots fit in x < x_limit
+        const unsigned y_limit  = sy >= 4 ? sy-3 : 0;
+        const unsigned x_cells  = cx2 - cx1;
+        const unsigned num_cells = x_cells * (cy2 - cy1);
+
+        unsigned table_size = 1;
+        while(table_size < 2 * std::min(x_divide, x_limit) * std::min(y_divide, y_limit))
+            table_size *= 2;
+
+        #pragma omp parallel for schedule(dynamic)
+        for(unsigned n=0; n<num_cells; ++n)
+        {
+            const unsigned cx = cx1 + n % x_cells, cy = cy1 + n / x_cells;
+            const unsigned cell = cy * x_shrunk + cx;
+            const unsigned x1 = cx * x_divide, x2 = std::min(x1 + x_divide, x_limit);
+            const unsigned y1 = cy * y_divide, y2 = std::min(y1 + y_divide, y_limit);
+            winners[cell] = ~0u;
+            if(x1 >= x2 || y1 >= y2) continue;
+
+            FrameArena::Scope cell_scratch;
+            RarityCount* table = FrameArena::Alloc<RarityCount>(table_size);
+            for(unsigned a=0; a<table_size; ++a) table[a].count = 0;
+
+            for(unsigned y=y1; y<y2; ++y)
+                for(unsigned p=y*sx+x1, x=x1; x<x2; ++x, ++p)
+                {
+                    const SpotType data = TestBit(Transparent + y*words, x)
+                                        ? SpotType() : GetSpot(Y, p, sx);
+                    unsigned slot = HashSpot(data) & (table_size-1);
+                    while(table[slot].count && table[slot].spot != data)
+                        slot = (slot+1) & (table_size-1);
+                    if(!table[slot].count++)
+                    {
+                        table[slot].spot  = data;
+                        table[slot].first = p;
+                    }
+                }
+
+            const RarityCount* winner = 0;
+            for(unsigned a=0; a<table_size; ++a)
+                if(table[a].count
+                && (!winner
+                 || table[a].count < winner->count
+                 || (table[a].count == winner->count && table[a].spot < winner->spot)))
+                    winner = &table[a];
+
+            winners[cell]      = winner->first;
+            winner_spots[cell] = winner->spot;
+        }
+    }
+}
+
+namespace
 {
-    return (((pix&0xFF0000u)*RY/(1<<16))
-          + ((pix&0x00FF00u)*GY/(1<<8))
-          + ((pix&0x0000FFu)*BY/(1<<0))
-          + RGB2YUV_MUL/2
-           ) / RGB2YUV_MUL;
-    // Get the luma in 0..255 range.
+    /* Orders spots by SpotType, then by coordinate */
+    struct SpotOrder
+    {
+        bool operator() (const InterestingSpot& a, const InterestingSpot& b) const
+        {
+            if(a.data != b.data) return a.data < b.data;
+            return a.where < b.where;
+        }
+    };
+    struct SpotDataOrder
+    {
+        bool operator() (const InterestingSpot& a, const InterestingSpot& b) const
+        {
+            return a.data < b.data;
+        }
+    };
+
+    /* The spots of one SpotType in the input and in the reference */
+    struct SpotGroup
+    {
+        size_t input_begin, input_end;
+        size_t reference_begin, reference_end;
+
+        size_t input_size() const { return input_end - input_begin; }
+
+        struct BySize
+        {
+            bool operator() (const SpotGroup& a, const SpotGroup& b) const
+            {
+                return a.input_size() < b.input_size();
+            }
+        };
+    };
+
+    /* An open-addressing hash set of spots,
+     * keyed by both the SpotType and the coordinate.
+     */
+    class SpotSet
+    {
+    public:
+        explicit SpotSet(const std::vector<InterestingSpot>& s) : spots(s)
+        {
+            unsigned size = 2;
+            while(size < spots.size() * 2) size *= 2;
+            mask = size-1;
+            table.resize(size, ~0u);
+            for(unsigned a=0; a<spots.size(); ++a)
+            {
+                unsigned slot = Hash(spots[a].data, spots[a].where) & mask;
+                while(table[slot] != ~0u) slot = (slot+1) & mask;
+                table[slot] = a;
+            }
+        }
+
+        bool Contains(const SpotType& data, const IntCoordinate& where) const
+        {
+            for(unsigned slot = Hash(data, where) & mask;
+                table[slot] != ~0u;
+                slot = (slot+1) & mask)
+            {
+                const InterestingSpot& s = spots[table[slot]];
+                if(s.where == where && s.data == data) return true;
+            }
+            return false;
+        }
+
+    private:
+        static unsigned Hash(const SpotType& data, const IntCoordinate& where)
+        {
+            uint64 h = HashSpot(data)
+                     ^ ((uint64(unsigned(where.x)) << 32) | unsigned(where.y));
+            h *= 0x9E3779B97F4A7C15ull;
+            return h >> 32;
+        }
+
+        const std::vector<InterestingSpot>& spots;
+        VecType<unsigned> table; // Indexes to spots, ~0u = unused
+        unsigned mask;
+    };
 }
 
 void FindInterestingSpots(
@@ -75,7 +334,8 @@ void FindInterestingSpots(
     const uint32* input,
     int xoffs, int yoffs,
     unsigned sx, unsigned sy,
-    bool force_all_pixels)
+    bool force_all_pixels,
+    const FrameLuma* luma)
 {
     /* Calculate the type and interestingness for all pixels.
      *
@@ -100,27 +360,19 @@ void FindInterestingSpots(
      * Actually save only Y value (luma/brightness); ignore U and V (chroma).
      * Also determine which pixels are transparent.
      */
-    VecType<char> Transparent(sx*sy, false);
-    VecType<unsigned char> Y(sx*sy);
-    for(unsigned p=0, y=0; y<sy; ++y)
-        for(unsigned x=0; x<sx; ++x, ++p)
-        {
-            if((input[p] & 0xFF000000u) == 0)
-            {
-                Y[p] = GetLuma(input[p]);
-            }
-            else
-            {
-                /* A single transparent pixel affects
-                 * a 4x4 section extending left and up
-                 * thereof, because Spots are calculated
-                 * from 4x4 squares.
-                 */
-                for(unsigned yos=0, yo=0; yo<4 && yo<=y; ++yo, yos+=sx)
-                    for(unsigned xo=0; xo<4 && xo<=x; ++xo)
-                        Transparent[p - xo - yos] = true;
-            }
-        }
+    FrameArena::Scope scratch;
+    const unsigned words = BitmapWordsPerRow(sx);
+    uint64*        Transparent = FrameArena::Alloc<uint64>(words*sy);
+    const unsigned char* Y;
+    if(luma)
+        Y = luma->Y.begin();
+    else
+    {
+        unsigned char* tmp = FrameArena::Alloc<unsigned char>(sx*sy);
+        GetLumaRow(tmp, input, sx*sy);
+        Y = tmp;
+    }
+    GetTransparencyBitmap(Transparent, input, sx,sy);
 
     const unsigned x_divide = force_all_pixels ? x_divide_input : x_divide_reference;
     const unsigned y_divide = force_all_pixels ? y_divide_input : y_divide_reference;
@@ -129,74 +381,117 @@ void FindInterestingSpots(
 
     output.reserve(output.size() + x_shrunk * y_shrunk);
 
-    VecType<SpotType> spots(sx*sy);
-    //unsigned randkey = 1;
-    for(unsigned p=0, y=0; y+4<=sy; ++y, p+=3)
-        for(unsigned x=0; x+4<=sx; ++x, ++p)
-        {
-            if(Transparent[p]) continue;
-            /* A sufficiently unique code describing this pixel
-             * should be made by comparing the brightness of this
-             * pixel to its immediate surroundings, scaled by the
-             * average.
-             * That was the plan. The implementation here is simpler,
-             * and simply takes a 4x4 pixel block of Y (brightness) values
-             * and stores them verbatim into 16 bytes (two 8-byte integers).
-             */
-            uint32 pix[4] = { *(uint32*)&Y[p     ],
-                              *(uint32*)&Y[p+sx  ],
-                              *(uint32*)&Y[p+sx*2],
-                              *(uint32*)&Y[p+sx*3] };
-            SpotType data ( pix[0] | (uint64(pix[1]) << 32),
-                            pix[2] | (uint64(pix[3]) << 32) );
-
-            if(x_divide==1 && y_divide==1)
+    if(x_divide==1 && y_divide==1)
+    {
+        //unsigned randkey = 1;
+        for(unsigned p=0, y=0; y+4<=sy; ++y, p+=3)
+            for(unsigned x=0; x+4<=sx; ++x, ++p)
             {
+                if(TestBit(Transparent + y*words, x)) continue;
                 //randkey = randkey*0x8088405+1;
                 //if((randkey % 3) == 0 || (x&3)==0)
                 {
-                    InterestingSpot spot { { int(xoffs+x), int(yoffs+y) }, data };
+                    InterestingSpot spot { { int(xoffs+x), int(yoffs+y) },
+                                           GetSpot(Y, p, sx) };
                     output.push_back(spot);
                 }
             }
-            else
-            {
-                spots[p] = data;
-            }
-        }
-
-    if(x_divide==1 && y_divide==1)
         return;
+    }
 
-    typedef std::map<SpotType, VecType<unsigned>,
-        std::less<SpotType>,
-        FSBAllocator<int> > RarityType;
+    unsigned* winners = FrameArena::Alloc<unsigned>(x_shrunk * y_shrunk);
+    SpotType* winner_spots = FrameArena::Alloc<SpotType>(x_shrunk * y_shrunk);
+    FindRarestSpots(winners, winner_spots, Y, Transparent, sx,sy,
+                    x_divide,y_divide, 0,x_shrunk, 0,y_shrunk);
 
-    VecType<RarityType> Rarities( x_shrunk * y_shrunk );
+    for(unsigned cell=0; cell<x_shrunk * y_shrunk; ++cell)
+    {
+        if(winners[cell] == ~0u) continue;
+        const unsigned coordinate = winners[cell];
+        InterestingSpot spot
+            { { int(xoffs+ coordinate%sx),
+                int(yoffs+ coordinate/sx) },
+              winner_spots[cell] };
+        output.push_back(spot);
+    }
+}
 
-    for(unsigned p=0, y=0; y+4<=sy; ++y, p+=3)
-        for(unsigned x=0; x+4<=sx; ++x, ++p)
-            Rarities[ (y/y_divide) * x_shrunk + (x/x_divide) ]
-                [ spots[p] ].push_back(p);
+void UpdateInterestingSpots(
+    CellSpots& cells,
+    const uint32* input,
+    int xoffs, int yoffs,
+    unsigned sx, unsigned sy,
+    unsigned x1, unsigned y1,
+    unsigned x2, unsigned y2)
+{
+    const unsigned x_divide = x_divide_reference;
+    const unsigned y_divide = y_divide_reference;
+    const unsigned x_shrunk = (sx + x_divide-1) / x_divide;
+    const unsigned y_shrunk = (sy + y_divide-1) / y_divide;
 
-    /* From each table, pick the least common PixelLabel,
-     * and show the first coordinate for it */
-    for(unsigned p=0, y=0; y<y_shrunk; ++y)
-        for(unsigned x=0; x<x_shrunk; ++x, ++p)
-        {
-            /* Pick the SpotType that occurs the least number of times */
-            const RarityType& r = Rarities[p];
-            RarityType::const_iterator winner = r.begin();
-            for(RarityType::const_iterator i = winner; ++i != r.end(); )
-                if(i->second.size() < winner->second.size())
-                    winner = i;
+    if(cells.spots.size() != x_shrunk * y_shrunk)
+    {
+        cells.spots.resize(x_shrunk * y_shrunk);
+        cells.found.assign(x_shrunk * y_shrunk, false);
+        x1 = y1 = 0; x2 = sx; y2 = sy;
+    }
+    if(x2 > sx) x2 = sx;
+    if(y2 > sy) y2 = sy;
+    if(x1 >= x2 || y1 >= y2) return;
+
+    /* The spot at x,y covers the pixels up to x+3,y+3,
+     * so the cells up to three pixels left and up from
+     * the changed pixels are affected too.
+     */
+    const unsigned cx1 = (x1 >= 3 ? x1-3 : 0) / x_divide, cx2 = (x2-1) / x_divide + 1;
+    const unsigned cy1 = (y1 >= 3 ? y1-3 : 0) / y_divide, cy2 = (y2-1) / y_divide + 1;
+
+    /* Only the rows of those cells are converted,
+     * and the three rows below them.
+     */
+    const unsigned row1 = cy1 * y_divide;
+    const unsigned row2 = std::min(cy2 * y_divide + 3, sy);
+
+    FrameArena::Scope scratch;
+    const unsigned words = BitmapWordsPerRow(sx);
+    uint64*        Transparent = FrameArena::Alloc<uint64>(words*sy);
+    unsigned char* Y           = FrameArena::Alloc<unsigned char>(sx*sy);
+    GetLumaRow(Y + row1*sx, input + row1*sx, (row2-row1)*sx);
+    GetTransparencyBitmap(Transparent + row1*words, input + row1*sx, sx, row2-row1);
 
-            const unsigned coordinate = winner->second.front();
+    if(x_divide==1 && y_divide==1)
+    {
+        for(unsigned y=cy1; y<cy2; ++y)
+            for(unsigned x=cx1; x<cx2; ++x)
+            {
+                const unsigned cell = y*sx + x;
+                cells.found[cell] = y+4 <= sy && x+4 <= sx
+                                 && !TestBit(Transparent + y*words, x);
+                if(!cells.found[cell]) continue;
+                InterestingSpot spot { { int(xoffs+x), int(yoffs+y) },
+                                       GetSpot(Y, cell, sx) };
+                cells.spots[cell] = spot;
+            }
+        return;
+    }
+
+    unsigned* winners = FrameArena::Alloc<unsigned>(x_shrunk * y_shrunk);
+    SpotType* winner_spots = FrameArena::Alloc<SpotType>(x_shrunk * y_shrunk);
+    FindRarestSpots(winners, winner_spots, Y, Transparent, sx,sy,
+                    x_divide,y_divide, cx1,cx2, cy1,cy2);
+
+    for(unsigned cy=cy1; cy<cy2; ++cy)
+        for(unsigned cx=cx1; cx<cx2; ++cx)
+        {
+            const unsigned cell = cy*x_shrunk + cx;
+            cells.found[cell] = winners[cell] != ~0u;
+            if(!cells.found[cell]) continue;
+            const unsigned coordinate = winners[cell];
             InterestingSpot spot
                 { { int(xoffs+ coordinate%sx),
                     int(yoffs+ coordinate/sx) },
-                  winner->first };
-            output.push_back(spot);
+                  winner_spots[cell] };
+            cells.spots[cell] = spot;
         }
 }
 
@@ -204,208 +499,233 @@ AlignResult Align(
     const std::vector<InterestingSpot>& input_spots,
     const std::vector<InterestingSpot>& reference_spots,
     int org_x,
-    int org_y)
+    int org_y,
+    bool limit_motion,
+    unsigned* n_matched)
 {
-    // Using multiset<> rather than set<> here
-    // because it has a simpler insert() method.
-    typedef std::multiset<IntCoordinate,
-        std::less<IntCoordinate>, FSBAllocator<int> > CoordSetType;
-    typedef std::map<SpotType, CoordSetType,
-        std::less<SpotType>, FSBAllocator<int> > SpotLocSetType;
-
-    SpotLocSetType input_spot_locations;
-    for(size_t b=input_spots.size(), a=0; a<b; ++a)
-    {
-        /*std::fprintf(stderr, "in[%3u/%3u]: %16llX,%16llX @ %d,%d\n",
-            (unsigned)a, (unsigned)b,
-            input_spots[a].data.first,
-            input_spots[a].data.second,
-            input_spots[a].where.x,
-            input_spots[a].where.y);*/
-        input_spot_locations[ input_spots[a].data ]
-            .insert( input_spots[a].where );
-    }
-
-    SpotLocSetType reference_spot_locations;
-    for(size_t b=reference_spots.size(), a=0; a<b; ++a)
-    {
-        /*std::fprintf(stderr, "ref[%3u]: %16llX,%16llX @ %d,%d\n",
-            (unsigned)a,
-            reference_spots[a].data.first,
-            reference_spots[a].data.second,
-            reference_spots[a].where.x,
-            reference_spots[a].where.y);*/
-        reference_spot_locations[ reference_spots[a].data ]
-            .insert( reference_spots[a].where );
-    }
-
-    /* Find a set of possible offsets */
-    typedef std::map<RelativeCoordinate, unsigned,
-        std::less<RelativeCoordinate>,
-        FSBAllocator<int> > OffsetSuggestions;
-    OffsetSuggestions offset_suggestions;
-    #ifdef _OPENMP
-    MutexType offset_suggestions_lock;
-    #endif
+    /* The range of motions considered */
+    const int min_x = limit_motion ? mv_xmin : -AnyMotion;
+    const int max_x = limit_motion ? mv_xmax :  AnyMotion;
+    const int min_y = limit_motion ? mv_ymin : -AnyMotion;
+    const int max_y = limit_motion ? mv_ymax :  AnyMotion;
+
+    /* Both spot lists are sorted by SpotType, and the coordinates
+     * of each SpotType by IntCoordinate. A SpotGroup is the range
+     * of one SpotType in the input, and the range of the same
+     * SpotType in the reference (empty if it does not occur there).
+     */
+    std::vector<InterestingSpot> input(input_spots);
+    std::vector<InterestingSpot> reference(reference_spots);
+    std::sort(input.begin(), input.end(), SpotOrder());
+    std::sort(reference.begin(), reference.end(), SpotOrder());
+
+    VecType<SpotGroup> groups;
+    for(size_t a=0; a<input.size(); )
+    {
+        SpotGroup g;
+        g.input_begin = a;
+        while(++a < input.size() && input[a].data == input[g.input_begin].data) { }
+        g.input_end = a;
+
+        auto r = std::equal_range(reference.begin(), reference.end(),
+                                  input[g.input_begin], SpotDataOrder());
+        g.reference_begin = r.first  - reference.begin();
+        g.reference_end   = r.second - reference.begin();
+        groups.push_back(g);
+    }
+
+    /* The input spots that have their SpotType in the reference.
+     * Only these can ever match.
+     */
+    VecType<InterestingSpot> matchable;
+    for(unsigned a=0; a<groups.size(); ++a)
+        if(groups[a].reference_begin != groups[a].reference_end)
+            matchable.insert(matchable.end(),
+                &input[groups[a].input_begin],
+                &input[0] + groups[a].input_end);
+
+    const SpotSet reference_set(reference);
+
+    /* Find a set of possible offsets.
+     * Only their presence matters, not the number of votes.
+     */
+    VecType<RelativeCoordinate> offset_suggestions;
 
     for(int y=-4; y<=4; ++y)
         for(int x=-4; x<=4; ++x)
-            offset_suggestions.insert
-                (std::make_pair( RelativeCoordinate(x,y), 999 ));
+            offset_suggestions.push_back( RelativeCoordinate(x,y) );
 
     /* If a rarely occurring vista is found in the reference picture,
      * add the offset to the list of offsets to be tested
      */
-  #pragma omp parallel
-  {
-   #pragma omp single
-   {
-    typedef
-    std::multimap<size_t, SpotLocSetType::const_iterator,
-                  std::less<size_t>, FSBAllocator<int> > InputSpotCounts;
-    InputSpotCounts input_spot_counts;
-    for(SpotLocSetType::const_iterator
-        i = input_spot_locations.begin();
-        i != input_spot_locations.end();
-        ++i)
-    {
-        input_spot_counts.insert(
-            std::pair<size_t, SpotLocSetType::const_iterator>
-                ( i->second.size(), i ) );
-    }
-    size_t n_inputs = 0;
-    for(InputSpotCounts::const_iterator
-        itmp = input_spot_counts.begin();
-        itmp != input_spot_counts.end();
-        ++itmp)
-    {
-        SpotLocSetType::const_iterator i ( itmp->second );
-        if(n_inputs < 50 || itmp->first <= 4)
-        {
-            ++n_inputs;
-          #pragma omp task firstprivate(i)
-          {
-            const CoordSetType& coords = i->second;
-            const SpotType& pixel = i->first;
-
-            SpotLocSetType::const_iterator r
-                = reference_spot_locations.find( pixel );
-            if(r != reference_spot_locations.end())
-            {
-                const CoordSetType& rcoords = r->second;
-                typedef CoordSetType::const_iterator it;
+    VecType<SpotGroup> voters(groups);
+    std::stable_sort(voters.begin(), voters.end(), SpotGroup::BySize());
+    for(unsigned a=0; a<voters.size(); ++a)
+        if(a >= 50 && voters[a].input_size() > 4)
+            { voters.resize(a); break; }
+
+    /* Each thread votes into a grid of its own, one bit per offset.
+     * The grid covers the offsets that are both within the mv range
+     * and geometrically possible. If that is too large, the votes
+     * are listed instead.
+     */
+    int vote_xmin = min_x, vote_xmax = max_x;
+    int vote_ymin = min_y, vote_ymax = max_y;
+    if(!input_spots.empty() && !reference_spots.empty())
+    {
+        IntCoordinate imin = input_spots[0].where, imax = imin;
+        IntCoordinate rmin = reference_spots[0].where, rmax = rmin;
+        for(size_t a=0; a<input_spots.size(); ++a)
+        {
+            const IntCoordinate& c = input_spots[a].where;
+            imin.x = std::min(imin.x, c.x); imax.x = std::max(imax.x, c.x);
+            imin.y = std::min(imin.y, c.y); imax.y = std::max(imax.y, c.y);
+        }
+        for(size_t a=0; a<reference_spots.size(); ++a)
+        {
+            const IntCoordinate& c = reference_spots[a].where;
+            rmin.x = std::min(rmin.x, c.x); rmax.x = std::max(rmax.x, c.x);
+            rmin.y = std::min(rmin.y, c.y); rmax.y = std::max(rmax.y, c.y);
+        }
+        vote_xmin = std::max(vote_xmin, rmin.x - org_x - imax.x);
+        vote_xmax = std::min(vote_xmax, rmax.x - org_x - imin.x);
+        vote_ymin = std::max(vote_ymin, rmin.y - org_y - imax.y);
+        vote_ymax = std::min(vote_ymax, rmax.y - org_y - imin.y);
+    }
+    const bool any_votes = vote_xmin <= vote_xmax && vote_ymin <= vote_ymax;
+    const uint64 vote_width  = any_votes ? vote_xmax - vote_xmin + 1 : 0;
+    const uint64 vote_height = any_votes ? vote_ymax - vote_ymin + 1 : 0;
+    const bool dense_votes = vote_width * vote_height <= MaxDenseVoteGrid;
+    const unsigned vote_words = dense_votes ? (vote_width * vote_height + 63) / 64 : 0;
+
+    VecType<uint64> votes(vote_words, 0);
 
-                for(it c=coords.begin(); c!=coords.end(); ++c)
+    if(any_votes)
+    {
+      #pragma omp parallel
+      {
+        VecType<uint64>             my_votes(vote_words, 0);
+        VecType<RelativeCoordinate> my_list;
+
+        #pragma omp for schedule(dynamic) nowait
+        for(unsigned a=0; a<voters.size(); ++a)
+        {
+            const SpotGroup& g = voters[a];
+
+            for(size_t c=g.input_begin; c<g.input_end; ++c)
+            {
+                size_t rmax = 0;
+                for(size_t d=g.reference_begin; d<g.reference_end; ++d)
                 {
-                    size_t rmax = 0;
-                    for(it d=rcoords.begin(); d!=rcoords.end(); ++d)
+                    int rx = (reference[d].where.x - org_x) - input[c].where.x;
+                    int ry = (reference[d].where.y - org_y) - input[c].where.y;
+                    if(rx < min_x || rx > max_x
+                    || ry < min_y || ry > max_y
+                    /*
+                    || (rx&&ry)*/) continue;
+                    if(dense_votes)
                     {
-                        int rx = (d->x - org_x) - (c->x);
-                        int ry = (d->y - org_y) - (c->y);
-                        if(rx < mv_xmin || rx > mv_xmax
-                        || ry < mv_ymin || ry > mv_ymax
-                        /*
-                        || (rx&&ry)*/) continue;
-                      {
-                        #ifdef _OPENMP
-                        ScopedLock lck(offset_suggestions_lock);
-                        #endif
-                        offset_suggestions[RelativeCoordinate(rx,ry)] += 1;
-                      }
-                        if(++rmax >= 80) break;
+                        uint64 bit = (ry-vote_ymin) * vote_width + (rx-vote_xmin);
+                        my_votes[bit / 64] |= uint64(1) << (bit % 64);
                     }
+                    else
+                        my_list.push_back( RelativeCoordinate(rx,ry) );
+                    if(++rmax >= 80) break;
                 }
             }
-          } // omp task
         }
+
+        #pragma omp critical(AlignVotes)
+        {
+            for(unsigned w=0; w<vote_words; ++w) votes[w] |= my_votes[w];
+            offset_suggestions.insert(offset_suggestions.end(),
+                my_list.begin(), my_list.end());
+        }
+      }
     }
-   } // omp single
-  } // omp parallel
+
+    for(unsigned w=0; w<vote_words; ++w)
+        for(uint64 bits = votes[w]; bits; bits &= bits-1)
+        {
+            uint64 bit = w*uint64(64) + __builtin_ctzll(bits);
+            offset_suggestions.push_back( RelativeCoordinate
+                (vote_xmin + int(bit % vote_width),
+                 vote_ymin + int(bit / vote_width)) );
+        }
+
+    std::sort(offset_suggestions.begin(), offset_suggestions.end());
+    offset_suggestions.erase(
+        std::unique(offset_suggestions.begin(), offset_suggestions.end()),
+        offset_suggestions.end());
 
     /* For each candidate offset that has sufficient confidence,
-     * find out the one that has most overlap in spots to the reference
+     * find out the one that has most overlap in spots to the reference.
+     * On a tie, the candidate that comes first in the above order wins.
      */
-    size_t             best_match = 0;
-    RelativeCoordinate best_coord(0,0);
-    #ifdef _OPENMP
-    MutexType best_lock;
-    #endif
+    size_t   best_match = 0;
+    unsigned best_index = ~0u;
 
   #pragma omp parallel
   {
-   #pragma omp single
-   {
-    for(OffsetSuggestions::const_iterator
-        i = offset_suggestions.begin();
-        i != offset_suggestions.end();
-        ++i)
+    size_t   my_best_match = 0;
+    unsigned my_best_index = ~0u;
+
+    #pragma omp for schedule(dynamic) nowait
+    for(unsigned a=0; a<offset_suggestions.size(); ++a)
     {
+        const RelativeCoordinate& relcoord = offset_suggestions[a];
         //if(i->second < 8) continue; // Not confident enough
-        if(i->first.x < mv_xmin
-        || i->first.x > mv_xmax
-        || i->first.y < mv_ymin
-        || i->first.y > mv_ymax/*
-        || (i->first.x && i->first.y)*/) continue; // Out of range
-
-      #pragma omp task firstprivate(i) shared(best_match,best_coord)
-      {
-        const RelativeCoordinate& relcoord = i->first;
+        if(relcoord.x < min_x
+        || relcoord.x > max_x
+        || relcoord.y < min_y
+        || relcoord.y > max_y/*
+        || (relcoord.x && relcoord.y)*/) continue; // Out of range
 
         size_t n_match = 0;
 
-        for(SpotLocSetType::const_iterator
-            j = input_spot_locations.begin();
-            j != input_spot_locations.end();
-            ++j)
+        for(unsigned k=0; k<matchable.size(); ++k)
         {
-            const SpotType& data = j->first;
-
-            SpotLocSetType::const_iterator
-                r = reference_spot_locations.find(data);
-            if(r == reference_spot_locations.end())
-                continue;
-
-            const CoordSetType& coords = j->second;
-            const CoordSetType& rcoords = r->second;
-            typedef CoordSetType::const_iterator it;
-
-            for(it k = coords.begin(); k != coords.end(); ++k)
-            {
-                const IntCoordinate& coord = *k;
-                IntCoordinate test_coord =
-                    {
-                        coord.x + org_x + relcoord.x,
-                        coord.y + org_y + relcoord.y
-                    };
-
-                it l = rcoords.find(test_coord);
-                if(l != rcoords.end())
+            const InterestingSpot& spot = matchable[k];
+            IntCoordinate test_coord =
                 {
-                    ++n_match;
-                }
+                    spot.where.x + org_x + relcoord.x,
+                    spot.where.y + org_y + relcoord.y
+                };
+            if(reference_set.Contains(spot.data, test_coord))
+            {
+                ++n_match;
             }
         }
 
-        /*std::fprintf(stderr, "Suggestion %d,%d (%u): %u\n",
-            i->first.x, i->first.y, i->second,
+        /*std::fprintf(stderr, "Suggestion %d,%d: %u\n",
+            relcoord.x, relcoord.y,
             (unsigned) n_match);*/
-        #ifdef _OPENMP
-        ScopedLock lck(best_lock);
-        #endif
-        if(n_match > best_match)
+        if(n_match > my_best_match
+        || (n_match == my_best_match && n_match && a < my_best_index))
         {
-            best_match = n_match,
-            best_coord = i->first;
+            my_best_match = n_match;
+            my_best_index = a;
         }
-      } // omp task
     }
-   } // omp single
+
+    #pragma omp critical(AlignBest)
+    if(my_best_match > best_match
+    || (my_best_match == best_match && my_best_match && my_best_index < best_index))
+    {
+        best_match = my_best_match;
+        best_index = my_best_index;
+    }
   } // omp parallel
 
+    RelativeCoordinate best_coord(0,0);
+    if(best_match) best_coord = offset_suggestions[best_index];
+
     /*std::fprintf(stderr, "Choice: %d,%d: %u\n",
         best_coord.x, best_coord.y,
         (unsigned) best_match);*/
 
+    if(n_matched) *n_matched = best_match;
+
     AlignResult result;
     result.suspect_reset = best_coord.length() > (16+16)
                  //      && (best_match < input_spots.size()/16)
@@ -416,13 +736,230 @@ AlignResult Align(
     return result;
 }
 
+namespace
+{
+    /* Placements within this distance from org are always tested
+     * by the brute-force Align(), besides those found by the
+     * coarse-to-fine search.
+     */
+    const int NearbyPlacements = 4;
+
+    /* Number of pyramid levels above the full resolution (8x),
+     * and the number of best placements refined on each level.
+     */
+    const unsigned PyramidLevels      = 3;
+    const unsigned PlacementsPerLevel = 8;
+
+    /* Maximum luma difference regarded as a match on coarse levels */
+    const int CoarseLumaTolerance = 6;
+
+    /* How many spots the brute-force Align() tests between
+     * checking whether the placement can still win.
+     */
+    const unsigned SpotsPerBoundCheck = 32;
+
+    /* Orders the scores of placements so that a higher score
+     * wins, and on a tie, the placement that comes first.
+     */
+    inline unsigned long long ScoreKey(unsigned score, unsigned index)
+    {
+        return ((unsigned long long)score << 32) | ~index;
+    }
+
+    /* The PCG32 random number generator (pcg-random.org).
+     * Each Align() has one of its own, always seeded the same,
+     * so the spots it tests do not depend on what else runs.
+     */
+    class SpotRandom
+    {
+    public:
+        explicit SpotRandom(uint64 seed) : state(0)
+        {
+            Next();
+            state += seed;
+            Next();
+        }
+
+        uint32 Next()
+        {
+            uint64 old = state;
+            state = old * 6364136223846793005ull + Increment;
+            uint32 xorshifted = ((old >> 18u) ^ old) >> 27u;
+            uint32 rot        = old >> 59u;
+            return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+        }
+
+    private:
+        static const uint64 Increment = 1442695040888963407ull;
+        uint64 state;
+    };
+
+    struct ScanlineOrder
+    {
+        bool operator() (const IntCoordinate& a, const IntCoordinate& b) const
+        {
+            if(a.y != b.y) return a.y < b.y;
+            return a.x < b.x;
+        }
+    };
+
+    inline int FloorDiv(int a, int b)
+    {
+        return a >= 0 ? a/b : -((b-1-a)/b);
+    }
+
+    /* A luma image for the coarse-to-fine search */
+    typedef FrameLuma::Level LumaImage;
+
+    void Downsample(LumaImage& target, const LumaImage& src)
+    {
+        target.width = src.width/2; target.height = src.height/2;
+        target.pixels.resize(target.width*target.height);
+        for(unsigned y=0; y<target.height; ++y)
+        {
+            const short* row0 = &src.pixels[(y*2  ) * src.width];
+            const short* row1 = &src.pixels[(y*2+1) * src.width];
+            short* out = &target.pixels[y*target.width];
+            for(unsigned x=0; x<target.width; ++x)
+            {
+                int a = row0[x*2], b = row0[x*2+1], c = row1[x*2], d = row1[x*2+1];
+                out[x] = (a|b|c|d) < 0 ? -1 : (a+b+c+d+2) / 4;
+            }
+        }
+    }
+
+    /* Counts the pixels of the input that match the background
+     * when the input is placed at px,py over it. Transparent
+     * background counts as a match, like in Align().
+     */
+    unsigned CoarseScore(const LumaImage& in, const LumaImage& bg, int px, int py)
+    {
+        const int xbegin = std::max(0, -px);
+        const int xend   = std::min((int)in.width, (int)bg.width - px);
+        const int ybegin = std::max(0, -py);
+        const int yend   = std::min((int)in.height, (int)bg.height - py);
+        unsigned score = 0;
+        if(xbegin >= xend) return 0;
+        for(int y=ybegin; y<yend; ++y)
+        {
+            const short* a = &in.pixels[y * in.width + xbegin];
+            const short* b = &bg.pixels[(y+py) * bg.width + (px+xbegin)];
+            for(int x=0; x<xend-xbegin; ++x)
+            {
+                int diff = a[x] - b[x];
+                score += a[x] >= 0
+                      && (b[x] < 0 || (diff <= CoarseLumaTolerance
+                                   && diff >= -CoarseLumaTolerance));
+            }
+        }
+        return score;
+    }
+
+    /* Scores the given placements on one level and keeps the best ones */
+    void KeepBestPlacements(VecType<IntCoordinate>& placements,
+                            const LumaImage& in, const LumaImage& bg)
+    {
+        std::sort(placements.begin(), placements.end(), ScanlineOrder());
+        placements.erase(
+            std::unique(placements.begin(), placements.end()),
+            placements.end());
+
+        VecType<std::pair<unsigned, unsigned> > scores(placements.size());
+        #pragma omp parallel for schedule(dynamic,16)
+        for(unsigned a=0; a<placements.size(); ++a)
+            scores[a] = std::make_pair(
+                ~CoarseScore(in, bg, placements[a].x, placements[a].y), a);
+
+        // Highest score first; on a tie, the one first in scanline order
+        unsigned keep = std::min<unsigned>(PlacementsPerLevel, scores.size());
+        std::partial_sort(scores.begin(), scores.begin()+keep, scores.end());
+
+        VecType<IntCoordinate> best;
+        for(unsigned a=0; a<keep; ++a)
+            best.push_back(placements[scores[a].second]);
+        placements.swap(best);
+    }
+
+    /* Finds the most likely placements of input over background
+     * within x1..x2, y1..y2 with a coarse-to-fine search over
+     * an image pyramid. Appends them to output.
+     */
+    void FindCoarsePlacements(VecType<IntCoordinate>& output,
+        const FrameLuma& background, const FrameLuma& input,
+        int x1, int x2, int y1, int y2)
+    {
+        const LumaImage* in = &input.pyramid[0];
+        const LumaImage* bg = &background.pyramid[0];
+
+        // Placements where the images do not overlap are pointless
+        x1 = std::max(x1, 1 - (int)in[0].width);  x2 = std::min(x2, (int)bg[0].width - 1);
+        y1 = std::max(y1, 1 - (int)in[0].height); y2 = std::min(y2, (int)bg[0].height - 1);
+        if(x1 > x2 || y1 > y2) return;
+
+        unsigned levels = 0;
+        while(levels < PyramidLevels
+           && in[levels].width >= 32 && in[levels].height >= 32)
+            ++levels;
+
+        // Everything within the range on the coarsest level
+        VecType<IntCoordinate> placements;
+        for(int y = FloorDiv(y1, 1<<levels); y <= FloorDiv(y2, 1<<levels); ++y)
+            for(int x = FloorDiv(x1, 1<<levels); x <= FloorDiv(x2, 1<<levels); ++x)
+            {
+                IntCoordinate c { x, y };
+                placements.push_back(c);
+            }
+        KeepBestPlacements(placements, in[levels], bg[levels]);
+
+        // Then the neighbourhood of the best ones on each finer level
+        while(levels-- > 0)
+        {
+            VecType<IntCoordinate> refined;
+            for(unsigned a=0; a<placements.size(); ++a)
+                for(int y = placements[a].y*2-1; y <= placements[a].y*2+2; ++y)
+                    for(int x = placements[a].x*2-1; x <= placements[a].x*2+2; ++x)
+                    {
+                        if(FloorDiv(x1, 1<<levels) > x || x > FloorDiv(x2, 1<<levels)
+                        || FloorDiv(y1, 1<<levels) > y || y > FloorDiv(y2, 1<<levels))
+                            continue;
+                        IntCoordinate c { x, y };
+                        refined.push_back(c);
+                    }
+            placements.swap(refined);
+            if(levels > 0)
+                KeepBestPlacements(placements, in[levels], bg[levels]);
+        }
+
+        output.insert(output.end(), placements.begin(), placements.end());
+    }
+}
+
+void FrameLuma::Load(const uint32* input, unsigned sx, unsigned sy)
+{
+    Y.resize(sx*sy);
+    GetLumaRow(Y.begin(), input, sx*sy);
+
+    pyramid.resize(PyramidLevels+1);
+    LumaImage& full = pyramid[0];
+    full.width = sx; full.height = sy;
+    full.pixels.resize(sx*sy);
+    for(unsigned a=0; a<sx*sy; ++a)
+        full.pixels[a] = (input[a] & 0xFF000000u) ? -1 : Y[a];
+    for(unsigned level=1; level<=PyramidLevels; ++level)
+        Downsample(pyramid[level], pyramid[level-1]);
+}
+
 AlignResult Align(
     const uint32* background,
     unsigned backwidth, unsigned backheight,
     const uint32* input,
     unsigned inputwidth, unsigned inputheight,
     int org_x,
-    int org_y)
+    int org_y,
+    int predict_x,
+    int predict_y,
+    const FrameLuma* back_luma,
+    const FrameLuma* input_luma)
 {
     /* TODO: Figure out where,
      * within background[], does input[] overlap.
@@ -440,19 +977,45 @@ AlignResult Align(
         return result;
     }
 
-    /* Find a set of possible offsets */
+    /* Find a set of possible offsets: the placements near org_x,org_y,
+     * and the best few ones found with a coarse-to-fine search.
+     */
     typedef VecType<std::pair<RelativeCoordinate, unsigned> > OffsetSuggestions;
     OffsetSuggestions offset_suggestions;
-    #ifdef _OPENMP
-    MutexType offset_suggestions_lock;
-    #endif
+    {
+        FrameLuma loaded_back, loaded_input;
+        if(!back_luma)
+            { loaded_back.Load(background, backwidth, backheight); back_luma = &loaded_back; }
+        if(!input_luma)
+            { loaded_input.Load(input, inputwidth, inputheight); input_luma = &loaded_input; }
 
-    for(int y=-37; y<=37; ++y)
-    for(int x=-37; x<=37; ++x)
-        offset_suggestions.push_back
-            (std::make_pair( RelativeCoordinate(x-org_x, y-org_y), 0 ));
+        VecType<IntCoordinate> placements;
+        FindCoarsePlacements(placements, *back_luma, *input_luma,
+            org_x + mv_xmin, org_x + mv_xmax,
+            org_y + mv_ymin, org_y + mv_ymax);
+
+        for(int y=-NearbyPlacements; y<=NearbyPlacements; ++y)
+            for(int x=-NearbyPlacements; x<=NearbyPlacements; ++x)
+            {
+                IntCoordinate c { org_x + x, org_y + y };
+                placements.push_back(c);
+            }
+        IntCoordinate predicted { org_x + predict_x, org_y + predict_y };
+        placements.push_back(predicted);
+
+        // Test them in scanline order, like the fixed grid used to be
+        std::sort(placements.begin(), placements.end(), ScanlineOrder());
+        placements.erase(
+            std::unique(placements.begin(), placements.end()),
+            placements.end());
+        for(unsigned a=0; a<placements.size(); ++a)
+            offset_suggestions.push_back(std::make_pair(
+                RelativeCoordinate(placements[a].x - org_x,
+                                   placements[a].y - org_y), 0u));
+    }
 
     VecType<IntCoordinate> rand_spots;
+    SpotRandom random(((uint64)inputwidth << 32) | inputheight);
     const unsigned x_divide = x_divide_reference;
     const unsigned y_divide = y_divide_reference;
     const unsigned n_rand_spots_per = ((x_divide*y_divide+59) / 60);
@@ -467,7 +1030,7 @@ AlignResult Align(
             unsigned ch = y_divide; if(sy+ch > inputheight) ch = inputheight-sy;
             for(unsigned n=0; n<n_rand_spots_per; ++n)
             {
-                IntCoordinate c { int(sx + (rand()%cw)), int(sy + (rand()%ch)) };
+                IntCoordinate c { int(sx + (random.Next()%cw)), int(sy + (random.Next()%ch)) };
                 rand_spots.push_back(c);
             }
         }
@@ -481,14 +1044,29 @@ AlignResult Align(
 
     unsigned best=0, worst=0;
 
-    /*VecType<unsigned char> InputLuma( inputwidth * inputheight );
-    #pragma omp parallel for schedule(static)
-    for(unsigned a=0; a<InputLuma.size(); ++a)
-        InputLuma[a] = GetLuma( input[a] );*/
-
-    #pragma omp parallel for schedule(guided)
+    /* Test the placements nearest to the predicted motion first.
+     * When the prediction is right, its score is soon known,
+     * and the others can be abandoned as soon as they can
+     * no longer beat it.
+     */
+    VecType<std::pair<unsigned, unsigned> > test_order;
     for(unsigned a=0; a<offset_suggestions.size(); ++a)
+        test_order.push_back(std::make_pair(
+            (unsigned) RelativeCoordinate(offset_suggestions[a].first.x - predict_x,
+                                          offset_suggestions[a].first.y - predict_y).length(),
+            a));
+    std::sort(test_order.begin(), test_order.end());
+
+    /* The best score so far, and the placement having it.
+     * A higher score wins, then the one that comes first.
+     */
+    std::atomic<unsigned long long> best_key(0);
+    const bool early_exit = verbose < 3; // The graph needs every score
+
+    #pragma omp parallel for schedule(dynamic,1)
+    for(unsigned o=0; o<test_order.size(); ++o)
     {
+        const unsigned a = test_order[o].second;
         OffsetSuggestions::iterator i = offset_suggestions.begin() + a;
 
         int rx = i->first.x;
@@ -499,8 +1077,14 @@ AlignResult Align(
         || (rx&&ry)*/) continue;
 
         unsigned n_match = 0;
+        bool abandoned   = false;
         for(unsigned b=0; b<rand_spots.size(); ++b)
         {
+            if(early_exit && b % SpotsPerBoundCheck == 0
+            && ScoreKey(n_match + rand_spots.size() - b, a)
+                 < best_key.load(std::memory_order_relaxed))
+                { abandoned = true; break; }
+
             const int ix = rand_spots[b].x;
             const int iy = rand_spots[b].y;
             const int bx = (rand_spots[b].x + rx + org_x);
@@ -530,39 +1114,23 @@ AlignResult Align(
             {
                 ++n_match;
             }
-            /*else
-            {
-                // Check if they still match when comparing their average
-                // relative brightnesses to their surroundings
-                unsigned in_luma = InputLuma[inptr-input];
-                unsigned bg_luma = GetLuma(*bgptr);
-                unsigned in_luma_sum = 0, in_luma_count = 0;
-                unsigned bg_luma_sum = 0, bg_luma_count = 0;
-                for(int offsx=-1; offsx<=1; ++offsx)
-                for(int offsy=-1; offsy<=1; ++offsy)
-                {
-                    if(bx+offsx >= 0 && bx+offsy < (int)backwidth
-                    && by+offsy >= 0 && by+offsy < (int)backheight)
-                        { bg_luma_sum += GetLuma(bgptr[offsy*(int)backwidth+offsx]);
-                          ++bg_luma_count; }
-                    if(ix+offsx >= 0 && ix+offsy < (int)inputwidth
-                    && iy+offsy >= 0 && iy+offsy < (int)inputheight)
-                        { bg_luma_sum += InputLuma[ &inptr[offsy*(int)inputwidth+offsx] - input ];
-                          ++bg_luma_count; }
-                }
-                double in_luma_ratio = in_luma / (in_luma_sum / (double)in_luma_count);
-                double bg_luma_ratio = bg_luma / (bg_luma_sum / (double)bg_luma_count);
-                if(in_luma_ratio == bg_luma_ratio)
-                    ++n_match;
-            }*/
         }
-        #ifdef _OPENMP
-        ScopedLock lck(offset_suggestions_lock);
-        #endif
-        i->second += n_match;
-        if(i->second > offset_suggestions[best].second)
+        if(abandoned) continue; // Could not win; leave its score at 0.
+        i->second = n_match;
+
+        const unsigned long long key = ScoreKey(n_match, a);
+        unsigned long long prev = best_key.load(std::memory_order_relaxed);
+        while(prev < key
+           && !best_key.compare_exchange_weak(prev, key, std::memory_order_relaxed))
+            { }
+    }
+
+    // On a tie, the one that comes first wins
+    for(unsigned a=0; a<offset_suggestions.size(); ++a)
+    {
+        if(offset_suggestions[a].second > offset_suggestions[best].second)
             best = a;
-        if(i->second < offset_suggestions[worst].second)
+        if(offset_suggestions[a].second < offset_suggestions[worst].second)
             worst = a;
     }
 
@@ -639,3 +1207,218 @@ AlignResult Align(
     }
     return result;
 }
+
+namespace
+{
+    /* Puts a Hann-windowed, zero-mean luma plane of width x height
+     * pixels of image, starting at (x0,y0), into the top-left corner
+     * of a fftwidth x fftheight target. Transparent pixels and pixels
+     * outside the image get zero weight; so does the padding.
+     * image_luma, if given, is the luma of image (see FrameLuma).
+     */
+    void LoadPhasePlane(double* target, unsigned fftwidth, unsigned fftheight,
+                        const uint32* image, unsigned sx, unsigned sy,
+                        int x0, int y0, unsigned width, unsigned height,
+                        const FrameLuma* image_luma)
+    {
+        std::memset(target, 0, fftwidth * fftheight * sizeof(*target));
+
+        double* xwindow = FrameArena::Alloc<double>(width);
+        double* ywindow = FrameArena::Alloc<double>(height);
+        for(unsigned x=0; x<width;  ++x) xwindow[x] = 0.5 - 0.5*std::cos(2*M_PI*(x+0.5)/width);
+        for(unsigned y=0; y<height; ++y) ywindow[y] = 0.5 - 0.5*std::cos(2*M_PI*(y+0.5)/height);
+
+        unsigned char* luma = FrameArena::Alloc<unsigned char>(width);
+        double* weight      = FrameArena::Alloc<double>(fftwidth * height);
+        double luma_sum = 0, weight_sum = 0;
+        for(unsigned y=0; y<height; ++y)
+        {
+            double* wrow = weight + y*fftwidth;
+            double* trow = target + y*fftwidth;
+            const int iy = y0 + (int)y;
+            if(iy < 0 || iy >= (int)sy)
+            {
+                for(unsigned x=0; x<width; ++x) wrow[x] = 0;
+                continue;
+            }
+            // Clip the row to the image
+            int xbegin = -x0 > 0 ? -x0 : 0;
+            int xend   = (int)sx - x0 < (int)width ? (int)sx - x0 : (int)width;
+            if(xend < xbegin) xend = xbegin;
+            for(int x=0; x<xbegin; ++x)              wrow[x] = 0;
+            for(int x=xend; x<(int)width; ++x)       wrow[x] = 0;
+
+            const uint32* src = image + iy*sx;
+            if(image_luma)
+                std::memcpy(luma + xbegin, image_luma->Y.begin() + iy*sx + x0 + xbegin, xend - xbegin);
+            else
+                GetLumaRow(luma + xbegin, src + x0 + xbegin, xend - xbegin);
+            for(int x=xbegin; x<xend; ++x)
+            {
+                double w = (src[x0+x] & 0xFF000000u) ? 0.0 : xwindow[x] * ywindow[y];
+                wrow[x] = w;
+                trow[x] = luma[x];
+                luma_sum   += w * luma[x];
+                weight_sum += w;
+            }
+        }
+        if(weight_sum <= 0) return;
+
+        // Remove the weighted mean, so that the window edges do not show up
+        const double mean = luma_sum / weight_sum;
+        for(unsigned y=0; y<height; ++y)
+            for(unsigned x=0; x<width; ++x)
+                target[y*fftwidth+x] = (target[y*fftwidth+x] - mean) * weight[y*fftwidth+x];
+    }
+
+    /* 2D real-to-complex transform of a width x height plane into
+     * height rows of width/2+1 values, or its inverse.
+     */
+    void PhaseTransform(double* plane, FFT::Complex* spectrum,
+                        unsigned width, unsigned height, bool inverse)
+    {
+        const unsigned cwidth = width/2 + 1;
+        if(inverse)
+        {
+            #pragma omp parallel for schedule(static)
+            for(unsigned x=0; x<cwidth; ++x)
+            {
+                FrameArena::Scope scratch;
+                FFT::Complex* column = FrameArena::Alloc<FFT::Complex>(height);
+                for(unsigned y=0; y<height; ++y) column[y] = spectrum[y*cwidth+x];
+                FFT::Transform(column, height, true);
+                for(unsigned y=0; y<height; ++y) spectrum[y*cwidth+x] = column[y];
+            }
+            #pragma omp parallel for schedule(static)
+            for(unsigned y=0; y<height; ++y)
+            {
+                FrameArena::Scope scratch;
+                FFT::Complex* tmp = FrameArena::Alloc<FFT::Complex>(width/2);
+                FFT::RealInverse(spectrum + y*cwidth, plane + y*width, width, tmp);
+            }
+            return;
+        }
+        #pragma omp parallel for schedule(static)
+        for(unsigned y=0; y<height; ++y)
+        {
+            FrameArena::Scope scratch;
+            FFT::Complex* tmp = FrameArena::Alloc<FFT::Complex>(width/2);
+            FFT::RealForward(plane + y*width, spectrum + y*cwidth, width, tmp);
+        }
+        #pragma omp parallel for schedule(static)
+        for(unsigned x=0; x<cwidth; ++x)
+        {
+            FrameArena::Scope scratch;
+            FFT::Complex* column = FrameArena::Alloc<FFT::Complex>(height);
+            for(unsigned y=0; y<height; ++y) column[y] = spectrum[y*cwidth+x];
+            FFT::Transform(column, height, false);
+            for(unsigned y=0; y<height; ++y) spectrum[y*cwidth+x] = column[y];
+        }
+    }
+}
+
+AlignResult AlignWithPhaseCorrelation(
+    const uint32* background,
+    unsigned backwidth, unsigned backheight,
+    const uint32* input,
+    unsigned inputwidth, unsigned inputheight,
+    int org_x,
+    int org_y,
+    const FrameLuma* back_luma,
+    const FrameLuma* input_luma)
+{
+    AlignResult result;
+    result.suspect_reset = false;
+    result.offs_x        = org_x;
+    result.offs_y        = org_y;
+    if(!backwidth || !backheight || !inputwidth || !inputheight)
+        return result;
+
+    unsigned fftwidth = 2, fftheight = 2;
+    while(fftwidth  < inputwidth)  fftwidth  *= 2;
+    while(fftheight < inputheight) fftheight *= 2;
+    const unsigned cwidth = fftwidth/2 + 1;
+
+    FrameArena::Scope scratch;
+    double* in_plane = FrameArena::Alloc<double>(fftwidth * fftheight);
+    double* bg_plane = FrameArena::Alloc<double>(fftwidth * fftheight);
+    FFT::Complex* in_spectrum = FrameArena::Alloc<FFT::Complex>(cwidth * fftheight);
+    FFT::Complex* bg_spectrum = FrameArena::Alloc<FFT::Complex>(cwidth * fftheight);
+
+    /* Compare the input with the part of the background
+     * where the previous frame was.
+     */
+    LoadPhasePlane(in_plane, fftwidth,fftheight, input, inputwidth,inputheight,
+                   0,0, inputwidth,inputheight, input_luma);
+    LoadPhasePlane(bg_plane, fftwidth,fftheight, background, backwidth,backheight,
+                   org_x,org_y, inputwidth,inputheight, back_luma);
+    PhaseTransform(in_plane, in_spectrum, fftwidth,fftheight, false);
+    PhaseTransform(bg_plane, bg_spectrum, fftwidth,fftheight, false);
+
+    // The normalized cross-power spectrum
+    for(unsigned a=0; a<cwidth*fftheight; ++a)
+    {
+        FFT::Complex r = bg_spectrum[a] * std::conj(in_spectrum[a]);
+        double magnitude = std::abs(r);
+        in_spectrum[a] = magnitude > 1e-9 ? r / magnitude : FFT::Complex(0.0);
+    }
+    PhaseTransform(in_plane, in_spectrum, fftwidth,fftheight, true);
+
+    /* Its peak is the motion. Shifts beyond half the size wrap around
+     * to negative ones. Only the shifts within mv range are considered.
+     */
+    int best_x = 0, best_y = 0;
+    double best_value = -1e300;
+    for(unsigned y=0; y<fftheight; ++y)
+    {
+        const int ry = y < fftheight/2 ? (int)y : (int)y - (int)fftheight;
+        if(ry < mv_ymin || ry > mv_ymax) continue;
+        for(unsigned x=0; x<fftwidth; ++x)
+        {
+            const int rx = x < fftwidth/2 ? (int)x : (int)x - (int)fftwidth;
+            if(rx < mv_xmin || rx > mv_xmax) continue;
+            // On a tie, the smaller motion wins
+            const double value = in_plane[y*fftwidth+x];
+            if(value > best_value
+            || (value == best_value
+             && std::abs(rx)+std::abs(ry) < std::abs(best_x)+std::abs(best_y)))
+                { best_value = value; best_x = rx; best_y = ry; }
+        }
+    }
+    if(best_value == -1e300)
+        return result;
+
+    result.offs_x = org_x + best_x;
+    result.offs_y = org_y + best_y;
+
+    /* Verify the placement the same way as the brute force Align() does:
+     * count the input pixels that match the background exactly.
+     */
+    unsigned n_tested = 0, n_match = 0;
+    #pragma omp parallel for schedule(static) reduction(+:n_tested,n_match)
+    for(unsigned y=0; y<inputheight; ++y)
+    {
+        const int by = result.offs_y + (int)y;
+        if(by < 0 || by >= (int)backheight) continue;
+        for(unsigned x=0; x<inputwidth; ++x)
+        {
+            const int bx = result.offs_x + (int)x;
+            if(bx < 0 || bx >= (int)backwidth) continue;
+            const uint32 in = input[y*inputwidth + x];
+            const uint32 bg = background[by*backwidth + bx];
+            if(in & 0xFF000000u) continue;
+            ++n_tested;
+            if((bg & 0xFF000000u) || in == bg) ++n_match;
+        }
+    }
+    result.suspect_reset = n_match < n_tested * 0.80;
+
+    if(verbose >= 3)
+        std::fprintf(stderr,
+            "Phase correlation: peak %g at %d,%d, matched %u/%u%s, estimate %d,%d\n",
+            best_value, best_x, best_y, n_match, n_tested,
+            result.suspect_reset ? "" : " [OK]",
+            result.offs_x, result.offs_y);
+
+    return result;
+}
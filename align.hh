@@ -3,6 +3,7 @@
 
 #include <vector>
 #include "types.hh"
+#include "vectype.hh"
 
 /* A two-dimensional coordinate */
 struct IntCoordinate
@@ -30,6 +31,35 @@ struct InterestingSpot
     SpotType        data;
 };
 
+/* The luma of a picture, as the aligners use it. A frame is
+ * loaded once, and then used for aligning it against the
+ * previous frame and against the canvas, and for aligning
+ * the next frame against it.
+ */
+struct FrameLuma
+{
+    /* One level of the image pyramid of Align(). On level n,
+     * each pixel is the average luma of a 2^n x 2^n block,
+     * or -1 if any pixel in the block is transparent.
+     */
+    struct Level
+    {
+        unsigned       width, height;
+        VecType<short> pixels;
+    };
+
+    VecType<unsigned char> Y;       // Luma of every pixel, even transparent ones
+    std::vector<Level>     pyramid; // Level 0 is the full size
+
+    void Load(const uint32* input, unsigned sx, unsigned sy);
+
+    void swap(FrameLuma& b)
+    {
+        Y.swap(b.Y);
+        pyramid.swap(b.pyramid);
+    }
+};
+
 /* Find points of interest from the input,
  * and insert them into the given vector.
  *    output:      Target vector to store the points in
@@ -40,13 +70,40 @@ struct InterestingSpot
  *        This tells where in the global map is the input bitmap located.
  *    force_all_pixels:
  *        true = this is input picture, false = this is background picture
+ *    luma:
+ *        If given, the luma of the input, as loaded by FrameLuma
  */
 void FindInterestingSpots(
     std::vector<InterestingSpot>& output,
     const uint32* input,
     int xoffs, int yoffs,
     unsigned sx, unsigned sy,
-    bool force_all_pixels);
+    bool force_all_pixels,
+    const FrameLuma* luma = 0);
+
+/* The points of interest of a reference picture, kept
+ * separately for each cell (x_divide_reference x
+ * y_divide_reference region) so that they can be
+ * updated one cell at a time.
+ */
+struct CellSpots
+{
+    std::vector<InterestingSpot> spots; // Indexed by cell
+    std::vector<bool>            found; // Whether the cell has a spot
+};
+
+/* Updates cells to what FindInterestingSpots() would find in
+ * the input with force_all_pixels=false, redoing only the cells
+ * that depend on the pixels within x1..x2-1, y1..y2-1.
+ * If cells is empty, all of them are done.
+ */
+void UpdateInterestingSpots(
+    CellSpots& cells,
+    const uint32* input,
+    int xoffs, int yoffs,
+    unsigned sx, unsigned sy,
+    unsigned x1, unsigned y1,
+    unsigned x2, unsigned y2);
 
 /* Attempts to align the input picture into the background picture
  *    input_spots:
@@ -59,6 +116,11 @@ void FindInterestingSpots(
  *        Offset of the previous frame within the background picture
  *        This is used for optimization: It is assumed that the next
  *        frame is likely somewhere near the previous frame.
+ *    limit_motion:
+ *        If false, motions outside the mv range are considered too.
+ *    n_matched:
+ *        If given, set to the number of spots that matched
+ *        in the suggested placement.
  * Result:
  *    offs_x, offs_y:
  *        Suggested placement of the input picture
@@ -71,7 +133,9 @@ struct AlignResult Align(
     const std::vector<InterestingSpot>& input_spots,
     const std::vector<InterestingSpot>& reference_spots,
     int org_x,
-    int org_y);
+    int org_y,
+    bool limit_motion = true,
+    unsigned* n_matched = 0);
 
 /* Attempts to align the input picture into the background picture
  * by finding a position where, if the input picture is placed
@@ -94,6 +158,13 @@ struct AlignResult Align(
  *        This can be used for optimization: It is usually likely
  *        that the next frame will be located a short distance
  *        away from the previous frame.
+ *    predict_x, predict_y:
+ *        Expected motion from org_x,org_y, e.g. that of the previous
+ *        frame. The placements nearest to it are tested first, which
+ *        makes the rest quicker to reject when the prediction is right.
+ *    back_luma, input_luma:
+ *        If given, the luma of the background and of the input,
+ *        as loaded by FrameLuma. Otherwise they are loaded here.
  * Pixel order is like this (for a bitmap where width=4, height=2):
  *    0123     upper-left coordinate is 0,0
  *    4567     bottom-right coordinate is 3,1
@@ -121,7 +192,27 @@ struct AlignResult Align(
     const uint32* input,
     unsigned inputwidth, unsigned inputheight,
     int org_x,
-    int org_y);
+    int org_y,
+    int predict_x = 0,
+    int predict_y = 0,
+    const FrameLuma* back_luma  = 0,
+    const FrameLuma* input_luma = 0);
+
+/* Same as the above, but finds the motion by phase correlation
+ * of the luma of the input picture and the part of the background
+ * picture at org_x,org_y. Costs the same regardless of how far the
+ * picture moved, but only finds motions shorter than half of the
+ * input picture's dimensions. Holes get zero weight.
+ */
+struct AlignResult AlignWithPhaseCorrelation(
+    const uint32* background,
+    unsigned backwidth, unsigned backheight,
+    const uint32* input,
+    unsigned inputwidth, unsigned inputheight,
+    int org_x,
+    int org_y,
+    const FrameLuma* back_luma  = 0,
+    const FrameLuma* input_luma = 0);
 
 struct AlignResult
 {
@@ -137,6 +228,8 @@ extern unsigned y_divide_input;
 extern unsigned x_divide_reference;
 extern unsigned y_divide_reference;
 extern bool always_align_with_canvas;
+extern bool use_phase_correlation;
+extern bool wide_hotspot_search;
 
 extern int mv_xmin, mv_ymin, mv_xmax, mv_ymax;
 
@@ -30,6 +30,24 @@ THE SOFTWARE.
 #include <cassert>
 #include <vector>
 
+/* FSBALLOCATOR_USE_THREAD_LOCAL_POOLS gives each thread a pool of its
+   own, so that allocating and freeing takes no lock at all. An element
+   freed by a thread other than the one that allocated it is pushed
+   onto a lock-free list of the owner pool, which the owner takes back
+   the next time its own free list runs empty. The pool of an exiting
+   thread is handed over to the next new thread. Memory is kept in the
+   pools for reuse and is not returned to the system.
+   (FSBAllocator2 is not thread-safe in this mode.) */
+#ifdef FSBALLOCATOR_USE_THREAD_LOCAL_POOLS
+#undef FSBALLOCATOR_USE_THREAD_SAFE_LOCKING_BOOST
+#undef FSBALLOCATOR_USE_THREAD_SAFE_LOCKING_OPENMP
+#undef FSBALLOCATOR_USE_THREAD_SAFE_LOCKING_PTHREAD
+#undef FSBALLOCATOR_USE_THREAD_SAFE_LOCKING_GCC
+#undef FSBALLOCATOR_USE_THREAD_SAFE_LOCKING_GCC_WITH_SCHED
+#include <atomic>
+#include <mutex>
+#endif
+
 #ifdef FSBALLOCATOR_USE_THREAD_SAFE_LOCKING_BOOST
 #undef FSBALLOCATOR_USE_THREAD_SAFE_LOCKING_OPENMP
 #undef FSBALLOCATOR_USE_THREAD_SAFE_LOCKING_PTHREAD
@@ -104,6 +122,139 @@ class FSBAllocator_Mutex
 };
 #endif
 
+#ifdef FSBALLOCATOR_USE_THREAD_LOCAL_POOLS
+template<unsigned ElemSize>
+class FSBAllocator_ElemAllocator
+{
+    typedef std::size_t Data_t;
+    static const Data_t BlockElements = 512;
+
+    static const Data_t DSize = sizeof(Data_t);
+    static const Data_t ElemSizeInDSize = (ElemSize + (DSize-1)) / DSize;
+    static const Data_t UnitSizeInDSize = ElemSizeInDSize + 1;
+    static const Data_t BlockSize = BlockElements*UnitSizeInDSize;
+
+    /* Each unit is the element followed by a pointer to its owner pool.
+       A free unit links to the next free unit through its first word. */
+    struct Pool
+    {
+        Data_t* freeList;                    // Freed by the owner thread
+        std::atomic<Data_t*> remoteFreeList; // Freed by other threads
+        Data_t* block;
+        Data_t endIndex;
+        Pool* nextOrphan;
+
+        Pool():
+            freeList(0), remoteFreeList(0),
+            block(0), endIndex(BlockSize), nextOrphan(0)
+        {}
+    };
+
+    /* Pools of exited threads. This is never destroyed, because
+       elements may still be freed during static destruction. */
+    struct Orphans
+    {
+        std::mutex lock;
+        Pool* first;
+
+        Orphans(): first(0) {}
+    };
+
+    static Orphans& orphans()
+    {
+        static Orphans* const list = new Orphans;
+        return *list;
+    }
+
+    struct PoolOwner
+    {
+        Pool* pool;
+
+        PoolOwner(): pool(0) {}
+        ~PoolOwner()
+        {
+            if(!pool) return;
+            Orphans& o = orphans();
+            std::lock_guard<std::mutex> lock(o.lock);
+            pool->nextOrphan = o.first;
+            o.first = pool;
+            currentPool = 0;
+        }
+    };
+
+    static thread_local Pool* currentPool;
+
+    static Pool* adoptPool()
+    {
+        static thread_local PoolOwner owner;
+
+        Orphans& o = orphans();
+        {
+            std::lock_guard<std::mutex> lock(o.lock);
+            owner.pool = o.first;
+            if(owner.pool) o.first = owner.pool->nextOrphan;
+        }
+        if(!owner.pool) owner.pool = new Pool;
+        return currentPool = owner.pool;
+    }
+
+ public:
+    static void* allocate()
+    {
+        Pool* pool = currentPool;
+        if(!pool) pool = adoptPool();
+
+        Data_t* unit = pool->freeList;
+        if(!unit)
+            unit = pool->remoteFreeList.exchange(0, std::memory_order_acquire);
+        if(unit)
+        {
+            pool->freeList = reinterpret_cast<Data_t*>(*unit);
+            return unit;
+        }
+
+        if(pool->endIndex == BlockSize)
+        {
+            pool->block = new Data_t[BlockSize];
+            pool->endIndex = 0;
+        }
+
+        unit = pool->block + pool->endIndex;
+        pool->endIndex += UnitSizeInDSize;
+        unit[ElemSizeInDSize] = reinterpret_cast<Data_t>(pool);
+        return unit;
+    }
+
+    static void deallocate(void* ptr)
+    {
+        if(!ptr) return;
+
+        Data_t* unit = (Data_t*)ptr;
+        Pool* owner = reinterpret_cast<Pool*>(unit[ElemSizeInDSize]);
+
+        if(owner == currentPool)
+        {
+            *unit = reinterpret_cast<Data_t>(owner->freeList);
+            owner->freeList = unit;
+            return;
+        }
+
+        Data_t* head = owner->remoteFreeList.load(std::memory_order_relaxed);
+        do *unit = reinterpret_cast<Data_t>(head);
+        while(!owner->remoteFreeList.compare_exchange_weak
+              (head, unit, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    bool operator!=(const FSBAllocator_ElemAllocator<ElemSize>& ) { return false; }
+    bool operator==(const FSBAllocator_ElemAllocator<ElemSize>& ) { return true; }
+};
+
+template<unsigned ElemSize>
+thread_local typename FSBAllocator_ElemAllocator<ElemSize>::Pool*
+FSBAllocator_ElemAllocator<ElemSize>::currentPool = 0;
+
+#else
+
 template<unsigned ElemSize>
 class FSBAllocator_ElemAllocator
 {
@@ -265,6 +416,8 @@ template<unsigned ElemSize>
 FSBAllocator_Mutex FSBAllocator_ElemAllocator<ElemSize>::mutex;
 #endif
 
+#endif // FSBALLOCATOR_USE_THREAD_LOCAL_POOLS
+
 
 template<unsigned ElemSize>
 class FSBAllocator2_ElemAllocator
@@ -0,0 +1,92 @@
+#ifndef bqtAnimMergerArenaHH
+#define bqtAnimMergerArenaHH
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/* Scratch memory for the large temporary buffers that are
+ * made for every frame. Each thread has an arena of its own.
+ * The memory is handed out from big chunks that are kept for
+ * as long as the thread lives, so once the first frames have
+ * been processed, these buffers cost no malloc, no free and
+ * no page faults anymore.
+ */
+class FrameArena
+{
+public:
+    /* Everything allocated by this thread while the Scope exists
+     * is released all at once when it ends. Scopes may be nested.
+     */
+    class Scope
+    {
+    public:
+        Scope() : arena(Get()), chunk(arena.chunk), used(arena.used) { }
+        ~Scope() { arena.chunk = chunk; arena.used = used; }
+    private: // prevent copying the scope.
+        Scope(const Scope&);
+        void operator=(const Scope&);
+    private:
+        FrameArena& arena;
+        std::size_t chunk, used;
+    };
+
+    /* Uninitialized room for count objects of a trivial type T.
+     * Valid until the innermost Scope of this thread ends.
+     */
+    template<typename T>
+    static T* Alloc(std::size_t count)
+    {
+        return static_cast<T*>( Get().Allocate(count * sizeof(T)) );
+    }
+
+private:
+    static const std::size_t Alignment    = 64;
+    static const std::size_t MinChunkSize = 4 << 20;
+
+    struct Chunk
+    {
+        char*       data;
+        std::size_t size;
+    };
+    std::vector<Chunk> chunks;
+    std::size_t chunk; // The chunk being allocated from
+    std::size_t used;  // Bytes used in that chunk
+
+    FrameArena() : chunks(), chunk(0), used(0) { }
+    ~FrameArena()
+    {
+        for(std::size_t a=0; a<chunks.size(); ++a)
+            ::operator delete(chunks[a].data, std::align_val_t(Alignment));
+    }
+
+    static FrameArena& Get()
+    {
+        static thread_local FrameArena arena;
+        return arena;
+    }
+
+    void* Allocate(std::size_t bytes)
+    {
+        bytes = (bytes + Alignment-1) & ~(Alignment-1);
+        for(; chunk < chunks.size(); ++chunk, used = 0)
+            if(chunks[chunk].size - used >= bytes)
+            {
+                char* result = chunks[chunk].data + used;
+                used += bytes;
+                return result;
+            }
+
+        // None of the remaining chunks has room. Add one.
+        Chunk c;
+        c.size = bytes > MinChunkSize ? bytes : MinChunkSize;
+        c.data = static_cast<char*>
+            ( ::operator new(c.size, std::align_val_t(Alignment)) );
+        chunks.push_back(c);
+        chunk = chunks.size()-1;
+        used  = bytes;
+        return c.data;
+    }
+};
+
+#endif
@@ -1,9 +1,12 @@
 #include <cstdio>
 #include <cmath>
 #include <iostream>
+#include <algorithm>
+#include <climits>
 
 #include "canvas.hh"
 #include "openmp.hh"
+#include "arena.hh"
 #include "align.hh"
 #include "palette.hh"
 #include "dither.hh"
@@ -373,13 +376,75 @@ static inline bool veq
     return std::memcmp(&a[0], &b[0], a.size() * sizeof(uint32)) == 0;
 }
 
+/* Sum of the absolute differences of the R, G and B components
+ * of count pixels. All bytes are summed first, which compiles into
+ * sum-of-absolute-differences instructions (PSADBW), and then the
+ * differences of the fourth bytes are taken out.
+ */
+static unsigned SumAbsoluteDifferences
+    (const uint32*__restrict a,
+     const uint32*__restrict b, unsigned count) VectorizedKernel;
+static unsigned SumAbsoluteDifferences
+    (const uint32*__restrict a,
+     const uint32*__restrict b, unsigned count)
+{
+    const unsigned char* abytes = (const unsigned char*) a;
+    const unsigned char* bbytes = (const unsigned char*) b;
+    unsigned sum = 0;
+    for(unsigned n=0; n<count*4; ++n)
+    {
+        int diff = abytes[n] - bbytes[n];
+        sum += diff < 0 ? -diff : diff;
+    }
+    for(unsigned n=0; n<count; ++n)
+    {
+        int diff = int(a[n] >> 24) - int(b[n] >> 24);
+        sum -= diff < 0 ? -diff : diff;
+    }
+    return sum;
+}
+
+const uint32* TILE_Tracker::cubetype::GetStatic() const
+{
+    if(static_image.empty())
+    {
+        static_image.resize(256*256);
+        static_dirty = DirtyRect();
+    }
+    if(!static_dirty.empty())
+    {
+        pixels->GetStaticSectionInto(
+            &static_image[static_dirty.y1*256 + static_dirty.x1], 256,
+            static_dirty.x1,
+            static_dirty.y1,
+            static_dirty.x2 - static_dirty.x1,
+            static_dirty.y2 - static_dirty.y1);
+        static_dirty.clear();
+    }
+    return &static_image[0];
+}
+
 const VecType<uint32>
 TILE_Tracker::LoadScreen(int ox,int oy, unsigned sx,unsigned sy,
                          unsigned timer,
                          PixelMethod method) const
 {
-    // Create the result vector filled with default pixel value
-    VecType<uint32> result(sy*sx, DefaultPixel);
+    VecType<uint32> result;
+    LoadScreens(ox,oy, sx,sy, timer, &method, 1, &result);
+    return result;
+}
+
+void TILE_Tracker::LoadScreens(int ox,int oy, unsigned sx,unsigned sy,
+                               unsigned timer,
+                               const PixelMethod* methods, unsigned nmethods,
+                               VecType<uint32>* results) const
+{
+    // Create the result vectors filled with default pixel value
+    for(unsigned k=0; k<nmethods; ++k)
+    {
+        results[k].clear();
+        results[k].resize(sy*sx, DefaultPixel);
+    }
 
     const int xbegin = ox;
     const int xend   = ox+sx-1;
@@ -431,13 +496,34 @@ TILE_Tracker::LoadScreen(int ox,int oy, unsigned sx,unsigned sy,
                      * it, since there's no real reason to initialize it at
                      * this point. */
 
-                    cube.pixels->GetLiveSectionInto(
-                        method,timer,
-                        &result[targetpos], sx,
-                        this_cube_xstart,
-                        this_cube_ystart,
-                        this_cube_xsize,
-                        this_cube_ysize);
+                    unsigned long live_methods = 0;
+                    uint32* live_targets[NPixelMethods];
+                    for(unsigned k=0; k<nmethods; ++k)
+                    {
+                        const PixelMethod method = methods[k];
+                        if(const uint32* source = cube.frozen.Render(method, timer))
+                        {
+                            source += this_cube_ystart*256 + this_cube_xstart;
+                            for(unsigned y=0; y<this_cube_ysize; ++y)
+                                std::memcpy(&results[k][targetpos + y*sx],
+                                            source + y*256,
+                                            this_cube_xsize * sizeof(uint32));
+                        }
+                        else
+                        {
+                            live_methods |= 1ul << method;
+                            live_targets[method] = &results[k][targetpos];
+                        }
+                    }
+                    /* Read the pixels once for all remaining methods */
+                    if(live_methods)
+                        cube.pixels->GetLiveSectionsInto(
+                            live_methods,timer,
+                            live_targets, sx,
+                            this_cube_xstart,
+                            this_cube_ystart,
+                            this_cube_xsize,
+                            this_cube_ysize);
                 }
 
                 targetpos+= this_cube_xsize;
@@ -451,15 +537,21 @@ TILE_Tracker::LoadScreen(int ox,int oy, unsigned sx,unsigned sy,
 
         this_cube_ystart=0;
     }
-
-    return result;
 }
 
 const VecType<uint32>
 TILE_Tracker::LoadBackground(int ox,int oy, unsigned sx,unsigned sy) const
 {
-    // Create the result vector filled with default pixel value
-    VecType<uint32> result(sy*sx, DefaultPixel);
+    VecType<uint32> result(sy*sx);
+    LoadBackground(&result[0], ox,oy, sx,sy);
+    return result;
+}
+
+void
+TILE_Tracker::LoadBackground(uint32* result, int ox,int oy, unsigned sx,unsigned sy) const
+{
+    // Fill the result with default pixel value
+    std::fill(result, result+sy*sx, DefaultPixel);
 
     const int xbegin = ox;
     const int xend   = ox+sx-1;
@@ -511,12 +603,12 @@ TILE_Tracker::LoadBackground(int ox,int oy, unsigned sx,unsigned sy) const
                      * it, since there's no real reason to initialize it at
                      * this point. */
 
-                    cube.pixels->GetStaticSectionInto(
-                        &result[targetpos], sx,
-                        this_cube_xstart,
-                        this_cube_ystart,
-                        this_cube_xsize,
-                        this_cube_ysize);
+                    const uint32* source = cube.GetStatic()
+                        + this_cube_ystart*256 + this_cube_xstart;
+                    for(unsigned y=0; y<this_cube_ysize; ++y)
+                        std::memcpy(&result[targetpos + y*sx],
+                                    source + y*256,
+                                    this_cube_xsize * sizeof(uint32));
                 }
 
                 targetpos+= this_cube_xsize;
@@ -530,14 +622,61 @@ TILE_Tracker::LoadBackground(int ox,int oy, unsigned sx,unsigned sy) const
 
         this_cube_ystart=0;
     }
+}
 
-    return result;
+bool
+TILE_Tracker::DiffersFromBackground
+    (const uint32* input, int ox,int oy, unsigned sx,unsigned sy,
+     unsigned long long limit) const
+{
+    /* Nearly the same as LoadBackground, but compares
+     * directly with the static image of each cube.
+     */
+    uint32 blank[256];
+    std::fill(blank, blank+256, DefaultPixel);
+
+    unsigned long long diff = 0;
+    for(unsigned y=0; y<sy; )
+    {
+        const unsigned cube_y = (oy+y) & 255;
+        const unsigned rows   = std::min(256-cube_y, sy-y);
+
+        ymaptype::const_iterator yi = screens.find( (oy+y) / 256 );
+        for(unsigned x=0; x<sx; )
+        {
+            const unsigned cube_x  = (ox+x) & 255;
+            const unsigned columns = std::min(256-cube_x, sx-x);
+
+            // Where there is no cube, the background is DefaultPixel
+            const uint32* source = blank;
+            unsigned      stride = 0;
+            if(yi != screens.end())
+            {
+                xmaptype::const_iterator xi = yi->second.find( (ox+x) / 256 );
+                if(xi != yi->second.end())
+                {
+                    source = xi->second.GetStatic() + cube_y*256 + cube_x;
+                    stride = 256;
+                }
+            }
+
+            for(unsigned row=0; row<rows; ++row)
+            {
+                diff += SumAbsoluteDifferences(
+                    &input[(y+row)*sx + x], source + row*stride, columns);
+                if(diff > limit) return true;
+            }
+            x += columns;
+        }
+        y += rows;
+    }
+    return false;
 }
 
 void
 TILE_Tracker::PutScreen
     (const uint32*const input, int ox,int oy, unsigned sx,unsigned sy,
-     unsigned timer)
+     unsigned timer, bool repeat)
 {
     /* Nearly the same as LoadScreen. */
 
@@ -581,20 +720,37 @@ TILE_Tracker::PutScreen
                 //cube.pixels.resize(256*256);
                 cube.pixels.init();
             }
-            cube.changed = true;
-
 /*
             std::fprintf(stderr, " Cube(%u,%u)-(%u,%u)\n",
                 this_cube_xstart,this_cube_xend,
                 this_cube_ystart,this_cube_yend);
 */
-            cube.pixels->PutSectionInto(
-                timer,
-                &input[targetpos], sx,
-                this_cube_xstart,
-                this_cube_ystart,
-                this_cube_xsize,
-                this_cube_ysize);
+            bool modified = true;
+            if(repeat)
+                modified = cube.pixels->RepeatSectionInto(
+                    timer,
+                    &input[targetpos], sx,
+                    this_cube_xstart,
+                    this_cube_ystart,
+                    this_cube_xsize,
+                    this_cube_ysize);
+            else
+                cube.pixels->PutSectionInto(
+                    timer,
+                    &input[targetpos], sx,
+                    this_cube_xstart,
+                    this_cube_ystart,
+                    this_cube_xsize,
+                    this_cube_ysize);
+
+            if(modified)
+            {
+                cube.static_dirty.add(this_cube_xstart, this_cube_ystart,
+                                      this_cube_xsize,  this_cube_ysize);
+                cube.spots_dirty.add(this_cube_xstart, this_cube_ystart,
+                                     this_cube_xsize,  this_cube_ysize);
+                if(cube.frozen.frozen) cube.frozen.Clear();
+            }
 
             targetpos+= this_cube_xsize;
 
@@ -627,17 +783,52 @@ bool TILE_Tracker::IsHeavyDithering(bool animated) const
     return false;
 }
 
-void TILE_Tracker::Save(unsigned method)
+void TILE_Tracker::Save(unsigned method, const VecType<uint32>* prerendered)
 {
     if(CurrentTimer == 0)
         return;
 
     if(method == ~0u)
     {
+        /* Render all the non-animated methods in a single pass
+         * over the cubes, and then feed each one to its own output.
+         */
+        PixelMethod static_methods[NPixelMethods];
+        VecType<uint32> static_screens[NPixelMethods];
+        const VecType<uint32>* screens[NPixelMethods] = { 0 };
+        unsigned nstatic = 0;
         for(unsigned m=0; m<NPixelMethods; ++m)
+            if((pixelmethods_result & (1ul << m))
+            && !((1ul << m) & AnimatedPixelMethodsMask))
+                static_methods[nstatic++] = (PixelMethod) m;
+
+        const unsigned wid = xmax-xmin, hei = ymax-ymin;
+        if(nstatic > 1 && wid > 1 && hei > 1)
         {
-            if(pixelmethods_result & (1ul << m))
-                Save( (PixelMethod) m);
+            LoadScreens(xmin,ymin, wid,hei, 0,
+                        static_methods, nstatic, static_screens);
+            for(unsigned k=0; k<nstatic; ++k)
+                screens[static_methods[k]] = &static_screens[k];
+        }
+
+        for(unsigned m=0; m<NPixelMethods; ++m)
+        {
+            if(!(pixelmethods_result & (1ul << m))) continue;
+            if(screens[m])
+            {
+                Save( (PixelMethod) m, screens[m]);
+                for(unsigned k=0; k<nstatic; ++k)
+                    if(static_methods[k] == m)
+                        VecType<uint32>().swap(static_screens[k]);
+                continue;
+            }
+            /* Animated methods are frozen one at a time, so that only
+             * the frames of the method being saved are kept around.
+             */
+            const bool animated = (1ul << m) & AnimatedPixelMethodsMask;
+            if(animated) Freeze(1ul << m);
+            Save( (PixelMethod) m );
+            if(animated) Thaw();
         }
         return;
     }
@@ -684,16 +875,43 @@ void TILE_Tracker::Save(unsigned method)
     {
         if(!PaletteReductionMethod.empty())
         {
-            CreatePalette( (PixelMethod) method, 1 );
+            CreatePalette( (PixelMethod) method, 1, prerendered );
         }
 
         for(unsigned dummy=0; dummy<1; ++dummy)
-            SaveFrame( (PixelMethod)method, 0, SequenceBegin);
+            SaveFrame( (PixelMethod)method, 0, SequenceBegin, prerendered);
     }
 }
 
+void TILE_Tracker::Freeze(unsigned long methods)
+{
+    /* Once the input is over, the pixels are only read.
+     * Convert each cube into a form that is cheap to read
+     * (see FrozenTile), one cube per thread.
+     */
+    std::vector<const cubetype*> cubes;
+    for(ymaptype::const_iterator yi = screens.begin(); yi != screens.end(); ++yi)
+        for(xmaptype::const_iterator xi = yi->second.begin(); xi != yi->second.end(); ++xi)
+            cubes.push_back(&xi->second);
+
+#ifdef _OPENMP
+    omp_set_nested(0);
+#endif
+    #pragma omp parallel for schedule(dynamic) if(cubes.size() > 1)
+    for(int n=0; n<(int)cubes.size(); ++n)
+        cubes[n]->pixels->Freeze(cubes[n]->frozen, methods);
+}
+
+void TILE_Tracker::Thaw()
+{
+    for(ymaptype::iterator yi = screens.begin(); yi != screens.end(); ++yi)
+        for(xmaptype::iterator xi = yi->second.begin(); xi != yi->second.end(); ++xi)
+            xi->second.frozen.Clear();
+}
+
 template<bool TransformColors>
-HistogramType TILE_Tracker::CountColors(PixelMethod method, unsigned nframes)
+HistogramType TILE_Tracker::CountColors(PixelMethod method, unsigned nframes,
+                                        const VecType<uint32>* prerendered)
 {
     HistogramType Histogram;
 
@@ -722,7 +940,9 @@ HistogramType TILE_Tracker::CountColors(PixelMethod method, unsigned nframes)
             /* Only count histogram from content that
              * changes between previous and current frame
              */
-            VecType<uint32> frame ( LoadScreen(xmi,ymi, wid,hei, frameno, method) );
+            VecType<uint32> frame ( prerendered
+                ? *prerendered
+                : LoadScreen(xmi,ymi, wid,hei, frameno, method) );
             unsigned a=0;
             for(; a < prev_frame.size() && a < frame.size(); ++a)
             {
@@ -779,7 +999,8 @@ HistogramType TILE_Tracker::CountColors(PixelMethod method, unsigned nframes)
     return Histogram;
 }
 
-void TILE_Tracker::CreatePalette(PixelMethod method, unsigned nframes)
+void TILE_Tracker::CreatePalette(PixelMethod method, unsigned nframes,
+                                 const VecType<uint32>* prerendered)
 {
     //return; // HACK: DON'T CHANGE PALETTE
 
@@ -806,8 +1027,8 @@ void TILE_Tracker::CreatePalette(PixelMethod method, unsigned nframes)
     #endif
 
     HistogramType Histogram = UsingTransformations
-        ? CountColors<true>(method, nframes)
-        : CountColors<false>(method, nframes);
+        ? CountColors<true>(method, nframes, prerendered)
+        : CountColors<false>(method, nframes, prerendered);
     ReduceHistogram(Histogram);
 
     const bool animated = (1ul << method) & AnimatedPixelMethodsMask;
@@ -816,7 +1037,8 @@ void TILE_Tracker::CreatePalette(PixelMethod method, unsigned nframes)
     CurrentPalette = MakePalette(Histogram, limit);
 }
 
-void TILE_Tracker::SaveFrame(PixelMethod method, unsigned frameno, unsigned img_counter)
+void TILE_Tracker::SaveFrame(PixelMethod method, unsigned frameno, unsigned img_counter,
+                             const VecType<uint32>* prerendered)
 {
     const bool animated = (1ul << method) & AnimatedPixelMethodsMask;
 
@@ -828,7 +1050,9 @@ void TILE_Tracker::SaveFrame(PixelMethod method, unsigned frameno, unsigned img_
 
     if(wid <= 1 || hei <= 1) return;
 
-    VecType<uint32> screen ( LoadScreen(xmi,ymi, wid,hei, frameno, method) );
+    VecType<uint32> screen ( prerendered
+        ? *prerendered
+        : LoadScreen(xmi,ymi, wid,hei, frameno, method) );
 
     const char* methodnamepiece = "tile";
     if(pixelmethods_result != (1ul << method))
@@ -1123,8 +1347,10 @@ gdImagePtr TILE_Tracker::CreateFrame_Palette_Dither_With(
     }
 
     const unsigned ErrorDiffusionMaxHeight = 4;
-    std::vector<GammaColorVec> Errors(
-        UseErrorDiffusion ? ErrorDiffusionMaxHeight*(wid+8) : 0 );
+    const unsigned NumErrors = UseErrorDiffusion ? ErrorDiffusionMaxHeight*(wid+8) : 0;
+    FrameArena::Scope scratch;
+    GammaColorVec* const Errors = FrameArena::Alloc<GammaColorVec>(NumErrors);
+    std::fill(Errors, Errors+NumErrors, GammaColorVec(0.0f));
 
     #pragma omp parallel for schedule(static,2) if(!UseErrorDiffusion)
     for(unsigned y=0; y<hei; ++y)
@@ -1456,7 +1682,8 @@ gdImagePtr TILE_Tracker::CreateFrame_Palette_Dither_CGA16(
 }
 
 AlignResult TILE_Tracker::TryAlignWithHotspots
-    (const uint32* input, unsigned sx,unsigned sy) const
+    (const uint32* input, unsigned sx,unsigned sy,
+     const FrameLuma* luma) const
 {
     /* Find spots of interest within the reference image,
      * and within the input image.
@@ -1467,95 +1694,145 @@ AlignResult TILE_Tracker::TryAlignWithHotspots
 
     std::vector<InterestingSpot> input_spots;
     std::vector<InterestingSpot> reference_spots;
-    FindInterestingSpots(input_spots, input, 0,0, sx,sy, true);
+    FindInterestingSpots(input_spots, input, 0,0, sx,sy, true, luma);
 
-    /* Cache InterestingSpot lists for each cube */
-    static std::map
-        <IntCoordinate, std::vector<InterestingSpot>,
-         std::less<IntCoordinate>,
-         FSBAllocator<int> > cache;
+    /* Only the cubes within the mv range from the previous
+     * position can contribute to an acceptable alignment.
+     */
+    GetReferenceSpots(reference_spots,
+        org_x + mv_xmin,      org_y + mv_ymin,
+        org_x + mv_xmax + (int)sx, org_y + mv_ymax + (int)sy);
+
+    unsigned n_matched = 0;
+    AlignResult result = Align(
+        input_spots,
+        reference_spots,
+        org_x, org_y,
+        true, &n_matched);
+    if(n_matched || !wide_hotspot_search)
+        return result;
+
+    /* Nothing matched nearby. Look at the whole canvas,
+     * regardless of the mv range.
+     */
+    reference_spots.clear();
+    GetReferenceSpots(reference_spots, INT_MIN,INT_MIN, INT_MAX,INT_MAX);
+    return Align(
+        input_spots,
+        reference_spots,
+        org_x, org_y,
+        false);
+}
+
+void TILE_Tracker::GetReferenceSpots
+    (std::vector<InterestingSpot>& output,
+     int x1,int y1, int x2,int y2) const
+{
+    if(x1 >= x2 || y1 >= y2) return;
 
     /* For speed reasons, we don't use LoadScreen(), but
-     * instead, work on cube-by-cube basis.
+     * instead, work on cube-by-cube basis. Each cube keeps
+     * its spots, and only redoes those where it has changed.
      */
+    const int xscreen_begin = x1/256, xscreen_end = (x2-1)/256;
+    const int yscreen_begin = y1/256, yscreen_end = (y2-1)/256;
+
     for(ymaptype::const_iterator
-        yi = screens.begin();
-        yi != screens.end();
+        yi = screens.lower_bound(yscreen_begin);
+        yi != screens.end() && yi->first <= yscreen_end;
         ++yi)
     {
         const int y_screen_offset = yi->first * 256;
 
         for(xmaptype::const_iterator
-            xi = yi->second.begin();
-            xi != yi->second.end();
+            xi = yi->second.lower_bound(xscreen_begin);
+            xi != yi->second.end() && xi->first <= xscreen_end;
             ++xi)
         {
             const int x_screen_offset = xi->first  * 256;
             const cubetype& cube      = xi->second;
 
-            IntCoordinate cache_key = {x_screen_offset,y_screen_offset};
-
-            if(cube.changed)
+            if(!cube.spots_dirty.empty())
             {
-                uint32 result[256*256];
-
-                cube.pixels->GetStaticInto(result, 256);
-
-                size_t prev_size = reference_spots.size();
-                FindInterestingSpots(reference_spots, result,
+                UpdateInterestingSpots(cube.spots, cube.GetStatic(),
                     x_screen_offset,y_screen_offset,
                     256,256,
-                    false);
-
-                cache[cache_key].assign(
-                    reference_spots.begin() + prev_size,
-                    reference_spots.end() );
-
-                cube.changed = false;
-            }
-            else
-            {
-                const std::vector<InterestingSpot>& found = cache[cache_key];
-                reference_spots.insert(
-                    reference_spots.end(),
-                    found.begin(),
-                    found.end());
+                    cube.spots_dirty.x1, cube.spots_dirty.y1,
+                    cube.spots_dirty.x2, cube.spots_dirty.y2);
+                cube.spots_dirty.clear();
             }
+
+            for(unsigned a=0; a<cube.spots.spots.size(); ++a)
+                if(cube.spots.found[a])
+                    output.push_back(cube.spots.spots[a]);
         }
     }
-
-    return Align(
-        input_spots,
-        reference_spots,
-        org_x, org_y);
 }
 
 AlignResult TILE_Tracker::TryAlignWithBackground
-    (const uint32* input, unsigned sx,unsigned sy) const
+    (const uint32* input, unsigned sx,unsigned sy,
+     const FrameLuma* luma) const
 {
-    struct AlignResult align =
-        Align(
-            &LoadBackground(xmin,ymin, xmax-xmin,ymax-ymin)[0],
-            xmax-xmin, ymax-ymin,
+    /* Only the part of the canvas that the input can cover
+     * when it moves within the mv range is needed.
+     */
+    const int wx1 = std::max(xmin, org_x + mv_xmin);
+    const int wy1 = std::max(ymin, org_y + mv_ymin);
+    const int wx2 = std::min(xmax, org_x + mv_xmax + (int)sx);
+    const int wy2 = std::min(ymax, org_y + mv_ymax + (int)sy);
+    const unsigned wwidth  = wx2 > wx1 ? wx2-wx1 : 0;
+    const unsigned wheight = wy2 > wy1 ? wy2-wy1 : 0;
+
+    FrameArena::Scope scratch;
+    uint32* background = FrameArena::Alloc<uint32>( wwidth * wheight );
+    if(wwidth && wheight)
+        LoadBackground(background, wx1,wy1, wwidth,wheight);
+
+    struct AlignResult align = use_phase_correlation
+        ? AlignWithPhaseCorrelation(
+            background,
+            wwidth, wheight,
+            input,
+            sx, sy,
+            org_x-wx1,
+            org_y-wy1,
+            0, luma
+        )
+        : Align(
+            background,
+            wwidth, wheight,
             input,
             sx, sy,
-            org_x-xmin,
-            org_y-ymin
+            org_x-wx1,
+            org_y-wy1,
+            motion_x, motion_y,
+            0, luma
         );
 
-    align.offs_x -= org_x-xmin;
-    align.offs_y -= org_y-ymin;
+    align.offs_x -= org_x-wx1;
+    align.offs_y -= org_y-wy1;
     return align;
 }
 
 AlignResult TILE_Tracker::TryAlignWithPrevFrame
     (const uint32* prev_input,
-     const uint32* input, unsigned sx,unsigned sy) const
+     const uint32* input, unsigned sx,unsigned sy,
+     const FrameLuma* prev_luma,
+     const FrameLuma* luma) const
 {
+    if(use_phase_correlation)
+        return AlignWithPhaseCorrelation(
+            prev_input, sx,sy,
+            input,      sx,sy,
+            0,0,
+            prev_luma, luma
+        );
     return Align(
         prev_input, sx,sy,
         input,      sx,sy,
-        0,0
+        0,0,
+        motion_x, motion_y,
+        prev_luma, luma
     );
 }
 
@@ -1564,20 +1841,42 @@ TILE_Tracker::FitScreenAutomatic
     (const uint32* input, unsigned sx,unsigned sy)
 {
     static VecType<uint32> prev_frame;
+    static FrameLuma       prev_luma;
     //fprintf(stderr, "sx=%u,sy=%u, prev_frame size=%u\n", sx,sy, prev_frame.size());
+
+    /* The luma is loaded once here, and kept for the next frame */
+    FrameLuma luma;
+    luma.Load(input, sx,sy);
+
+    AlignResult align;
+    align.offs_x = align.offs_y = 0;
+    align.suspect_reset = true;
     if(prev_frame.size() == sx*sy && !always_align_with_canvas)
+        align = TryAlignWithPrevFrame(&prev_frame[0], input,sx,sy, &prev_luma, &luma);
+    prev_frame.assign(input, input+sx*sy);
+
+    FitScreenAutomatic(input,sx,sy, align, &luma);
+    prev_luma.swap(luma);
+}
+
+void
+TILE_Tracker::FitScreenAutomatic
+    (const uint32* input, unsigned sx,unsigned sy,
+     const AlignResult& prev_frame_alignment,
+     const FrameLuma* luma)
+{
+    if(!prev_frame_alignment.suspect_reset)
     {
-        AlignResult align = TryAlignWithPrevFrame(&prev_frame[0], input,sx,sy);
-        if(!align.suspect_reset)
-        {
-            prev_frame.assign(input, input+sx*sy);
-            FitScreen(input,sx,sy, align);
-            return;
-        }
+        FitScreen(input,sx,sy, prev_frame_alignment);
+        return;
     }
-    prev_frame.assign(input, input+sx*sy);
 
-    AlignResult align = TryAlignWithHotspots(input,sx,sy);
+    /* With --nofastalign, the input is compared against the
+     * pixels of the canvas rather than just its hotspots.
+     */
+    AlignResult align = always_align_with_canvas
+        ? TryAlignWithBackground(input,sx,sy, luma)
+        : TryAlignWithHotspots(input,sx,sy, luma);
     FitScreen(input,sx,sy, align);
 }
 
@@ -1595,6 +1894,7 @@ void TILE_Tracker::FitScreen
     }
 
     org_x += alignment.offs_x; org_y += alignment.offs_y;
+    motion_x = alignment.offs_x; motion_y = alignment.offs_y;
 
     int this_org_x = org_x + extra_offs_x;
     int this_org_y = org_y + extra_offs_y;
@@ -1604,26 +1904,7 @@ void TILE_Tracker::FitScreen
 #if 0
         goto AlwaysReset;
 #endif
-        VecType<uint32> oldbuf = LoadScreen(this_org_x,this_org_y, sx,sy, CurrentTimer, bgmethod);
-        unsigned diff = 0;
-        for(unsigned a=0; a<oldbuf.size(); ++a)
-        {
-            unsigned oldpix = oldbuf[a];
-            unsigned pix   = input[a];
-            unsigned r = (pix >> 16) & 0xFF;
-            unsigned g = (pix >> 8) & 0xFF;
-            unsigned b = (pix    ) & 0xFF;
-            unsigned oldr = (oldpix >> 16) & 0xFF;
-            unsigned oldg = (oldpix >> 8) & 0xFF;
-            unsigned oldb = (oldpix    ) & 0xFF;
-            int rdiff = (int)(r-oldr); if(rdiff < 0)rdiff=-rdiff;
-            int gdiff = (int)(g-oldg); if(gdiff < 0)gdiff=-gdiff;
-            int bdiff = (int)(b-oldb); if(bdiff < 0)bdiff=-bdiff;
-            unsigned absdiff = rdiff+gdiff+bdiff;
-            diff += absdiff;
-        }
-
-        if(diff > oldbuf.size() * 128)
+        if(DiffersFromBackground(input, this_org_x,this_org_y, sx,sy, sx*sy * 128ull))
         {
 #if 0
             /* Castlevania hack */
@@ -1658,6 +1939,14 @@ void TILE_Tracker::FitScreen
     PutScreen(input, this_org_x,this_org_y, sx,sy, CurrentTimer);
 }
 
+void TILE_Tracker::RepeatScreen(const uint32* input, unsigned sx,unsigned sy)
+{
+    std::fprintf(stderr, "[frame%5u] Repeat, Origo(%d,%d)\n",
+        CurrentTimer, org_x,org_y);
+
+    PutScreen(input, org_x,org_y, sx,sy, CurrentTimer, true);
+}
+
 void TILE_Tracker::Reset()
 {
     SequenceBegin += CurrentTimer;
@@ -1667,6 +1956,7 @@ void TILE_Tracker::Reset()
     screens.clear();
     org_x = 0x40000000;
     org_y = 0x40000000;
+    motion_x = motion_y = 0;
     xmin=xmax=org_x;
     ymin=ymax=org_y;
 }
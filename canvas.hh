@@ -11,6 +11,7 @@
 #include "vectype.hh"
 #include "alloc/FSBAllocator.hh"
 #include "palette.hh"
+#include "align.hh"
 
 extern "C" {
 //#include <gd.h>
@@ -21,8 +22,6 @@ extern int SaveGif;
 extern bool UseDitherCache;
 extern std::string OutputNameTemplate;
 
-struct AlignResult;
-
 class dither_cache_t;
 class transform_cache_t;
 class transform_caches_t;
@@ -30,16 +29,51 @@ class transform_caches_t;
 class TILE_Tracker
 {
     int org_x, org_y;
+    int motion_x, motion_y; // Motion of the latest frame, for predicting the next
 
     int xmin,ymin;
     int xmax,ymax;
 
     typedef UncertainPixelVector256x256 vectype;
 
+    /* A rectangle of a cube that was written since last use */
+    struct DirtyRect
+    {
+        unsigned x1,y1, x2,y2; // x2,y2 are exclusive
+
+        DirtyRect() : x1(0),y1(0), x2(256),y2(256) { }
+
+        bool empty() const { return x1 >= x2 || y1 >= y2; }
+        void clear() { x1=y1=256; x2=y2=0; }
+        void add(unsigned x,unsigned y, unsigned width,unsigned height)
+        {
+            if(x < x1) x1 = x;
+            if(y < y1) y1 = y;
+            if(x+width  > x2) x2 = x+width;
+            if(y+height > y2) y2 = y+height;
+        }
+    };
+
     struct cubetype
     {
-        mutable bool changed;
         vectype pixels;
+
+        /* The bgmethod image of the pixels. Only the part
+         * within static_dirty is recomputed when it is used.
+         */
+        mutable VecType<uint32> static_image;
+        mutable DirtyRect       static_dirty;
+
+        /* Points of interest of the static image, for aligning.
+         * Only the cells touching spots_dirty are redone.
+         */
+        mutable CellSpots spots;
+        mutable DirtyRect spots_dirty;
+
+        /* Read-only form of the pixels, used while saving */
+        mutable FrozenTile frozen;
+
+        const uint32* GetStatic() const;
     };
 
     typedef std::map<int,cubetype, std::less<int>, FSBAllocator<int> > xmaptype;
@@ -65,9 +99,17 @@ public:
     {
     }
 
-    void Save(unsigned method = ~0u);
+    /* prerendered, if given, is the image of a non-animated method */
+    void Save(unsigned method = ~0u, const VecType<uint32>* prerendered = 0);
+
+    /* Converts every cube into its read-only form for saving
+     * the given methods (a bitmask of PixelMethods).
+     */
+    void Freeze(unsigned long methods);
+    void Thaw();
 
-    void SaveFrame(PixelMethod method, unsigned timer, unsigned imgcounter);
+    void SaveFrame(PixelMethod method, unsigned timer, unsigned imgcounter,
+                   const VecType<uint32>* prerendered = 0);
 
     typedef std::pair<void*,int> ImgResult;
 
@@ -97,30 +139,70 @@ public:
         unsigned frameno, unsigned wid, unsigned hei,
         const Palette& pal);
 
-    void CreatePalette(PixelMethod method, unsigned nframes);
+    void CreatePalette(PixelMethod method, unsigned nframes,
+                       const VecType<uint32>* prerendered = 0);
 
     template<bool TransformColors>
-    struct HistogramType CountColors(PixelMethod method, unsigned nframes);
+    struct HistogramType CountColors(PixelMethod method, unsigned nframes,
+                                     const VecType<uint32>* prerendered = 0);
 
     void Reset();
 
     const VecType<uint32> LoadScreen(int ox,int oy, unsigned sx,unsigned sy,
                                      unsigned timer,
                                      PixelMethod method) const;
+    /* Same as LoadScreen for several methods at once, reading
+     * each cube only once. Method methods[n] goes into results[n].
+     */
+    void LoadScreens(int ox,int oy, unsigned sx,unsigned sy,
+                     unsigned timer,
+                     const PixelMethod* methods, unsigned nmethods,
+                     VecType<uint32>* results) const;
     const VecType<uint32> LoadBackground(int ox,int oy, unsigned sx,unsigned sy) const;
+    void LoadBackground(uint32* result, int ox,int oy, unsigned sx,unsigned sy) const;
 
+    /* Tells whether the sum of the absolute differences of the
+     * R, G and B components between the input and the background
+     * at ox,oy exceeds limit. Stops comparing as soon as it does.
+     */
+    bool DiffersFromBackground(const uint32* input, int ox,int oy,
+                               unsigned sx,unsigned sy,
+                               unsigned long long limit) const;
+
+    /* With repeat=true, input is the same as in the previous call */
     void PutScreen(const uint32*const input, int ox,int oy, unsigned sx,unsigned sy,
-                   unsigned timer);
+                   unsigned timer, bool repeat = false);
 
     void FitScreenAutomatic(const uint32* input, unsigned sx,unsigned sy);
 
+    /* Same as above, with the alignment against the previous
+     * frame already done (see TryAlignWithPrevFrame). If it
+     * is suspect, the input is aligned with the canvas instead.
+     * luma, if given, is that of the input.
+     */
+    void FitScreenAutomatic(const uint32* input, unsigned sx,unsigned sy,
+                            const AlignResult& prev_frame_alignment,
+                            const FrameLuma* luma = 0);
+
+    /* In the TryAlignWith functions, luma and prev_luma, if given,
+     * are those of input and prev_input (see FrameLuma).
+     */
     AlignResult TryAlignWithHotspots(
-        const uint32* input, unsigned sx,unsigned sy) const;
+        const uint32* input, unsigned sx,unsigned sy,
+        const FrameLuma* luma = 0) const;
+    /* Adds the points of interest of the cubes that overlap
+     * the region x1..x2-1, y1..y2-1 into output.
+     */
+    void GetReferenceSpots(std::vector<InterestingSpot>& output,
+                           int x1,int y1, int x2,int y2) const;
     AlignResult TryAlignWithPrevFrame(
         const uint32* prev_input,
-        const uint32* input, unsigned sx,unsigned sy) const;
+        const uint32* input, unsigned sx,unsigned sy,
+        const FrameLuma* prev_luma = 0,
+        const FrameLuma* luma = 0) const;
     AlignResult TryAlignWithBackground(
-        const uint32* input, unsigned sx,unsigned sy) const;
+        const uint32* input, unsigned sx,unsigned sy,
+        const FrameLuma* luma = 0) const;
 
     void FitScreen(const uint32* input, unsigned sx,unsigned sy,
                    const AlignResult& alignment,
@@ -128,6 +210,12 @@ public:
                    int extra_offs_y=0
                   );
 
+    /* For an input frame identical to the previous one:
+     * keeps the previous alignment and only advances the timer
+     * in the cubes that it covers.
+     */
+    void RepeatScreen(const uint32* input, unsigned sx,unsigned sy);
+
     void NextFrame();
 
     bool IsHeavyDithering(bool animated) const;
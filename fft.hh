@@ -0,0 +1,85 @@
+#ifndef bqtAnimMergerFFTHH
+#define bqtAnimMergerFFTHH
+
+#include <cmath>
+#include <complex>
+#include <utility>
+
+/* A small radix-2 FFT for the phase correlation aligner.
+ * All sizes must be powers of two. The transforms are unscaled.
+ */
+namespace FFT
+{
+    typedef std::complex<double> Complex;
+
+    /* In-place complex transform of n values. */
+    inline void Transform(Complex* data, unsigned n, bool inverse)
+    {
+        for(unsigned i=1, j=0; i<n; ++i)
+        {
+            unsigned bit = n >> 1;
+            for(; j & bit; bit >>= 1) j ^= bit;
+            j ^= bit;
+            if(i < j) std::swap(data[i], data[j]);
+        }
+        for(unsigned len=2; len<=n; len<<=1)
+        {
+            const double angle = (inverse ? 2 : -2) * M_PI / len;
+            const Complex step(std::cos(angle), std::sin(angle));
+            for(unsigned i=0; i<n; i+=len)
+            {
+                Complex w(1.0);
+                for(unsigned j=0; j<len/2; ++j, w *= step)
+                {
+                    Complex u = data[i+j], v = data[i+j+len/2] * w;
+                    data[i+j]       = u+v;
+                    data[i+j+len/2] = u-v;
+                }
+            }
+        }
+    }
+
+    /* Real-to-complex transform of n real values into n/2+1
+     * complex values (the rest is their conjugate mirror).
+     * Done as one complex transform of size n/2.
+     * scratch must have room for n/2 values.
+     */
+    inline void RealForward(const double* in, Complex* out, unsigned n, Complex* scratch)
+    {
+        const unsigned m = n/2;
+        for(unsigned k=0; k<m; ++k)
+            scratch[k] = Complex(in[2*k], in[2*k+1]);
+        Transform(scratch, m, false);
+        for(unsigned k=0; k<=m; ++k)
+        {
+            Complex a = scratch[k % m], b = std::conj(scratch[(m-k) % m]);
+            Complex even = (a + b) * 0.5;
+            Complex odd  = (a - b) * Complex(0, -0.5);
+            out[k] = even + std::polar(1.0, -M_PI * k / m) * odd;
+        }
+    }
+
+    /* Inverse of RealForward. The result is n/2 times
+     * the original values.
+     * scratch must have room for n/2 values.
+     */
+    inline void RealInverse(const Complex* in, double* out, unsigned n, Complex* scratch)
+    {
+        const unsigned m = n/2;
+        for(unsigned k=0; k<m; ++k)
+        {
+            Complex a = in[k], b = std::conj(in[m-k]);
+            Complex even = (a + b) * 0.5;
+            Complex odd  = (a - b) * 0.5 * std::polar(1.0, M_PI * k / m);
+            scratch[k] = even + Complex(0,1) * odd;
+        }
+        Transform(scratch, m, true);
+        for(unsigned k=0; k<m; ++k)
+        {
+            out[2*k]   = scratch[k].real();
+            out[2*k+1] = scratch[k].imag();
+        }
+    }
+}
+
+#endif
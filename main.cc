@@ -42,6 +42,94 @@ namespace
 {
     rangemap<unsigned long, std::pair<int,int>> forced_align;
 
+    /* Number of frames decoded before they are all aligned
+     * against their previous frames at once (--batchalign)
+     */
+    unsigned align_batch = 1;
+
+    /* A decoded input frame, waiting to be put on the canvas */
+    struct InputFrame
+    {
+        VecType<uint32> pixels;    // Masked. Empty if repeat.
+        unsigned        sx, sy;
+        bool            repeat;    // Identical to the previous frame
+        bool            automatic; // Aligned with FitScreenAutomatic
+        bool            forced;    // Aligned with forced_align
+        AlignResult     align;     // Forced alignment, or the alignment
+                                   // against the previous automatic frame
+        FrameLuma       luma;      // Of pixels, loaded in batch mode
+    };
+
+    /* Puts the frames on the canvas in order.
+     *    last:      The latest non-repeat frame before them.
+     *    last_auto: The latest automatically aligned frame before them.
+     *    last_auto_luma: Its luma, in batch mode.
+     * On return, all are updated to what they are after the frames.
+     * With batch=true, the alignments of the automatic frames against
+     * their previous automatic frames are computed first, in parallel,
+     * and the canvas is only consulted for those that fail.
+     */
+    void PutFrames(TILE_Tracker& tracker,
+                   std::vector<InputFrame>& frames,
+                   VecType<uint32>& last,
+                   VecType<uint32>& last_auto,
+                   FrameLuma& last_auto_luma,
+                   bool batch)
+    {
+        if(batch)
+        {
+            std::vector<InputFrame*> autos;
+            for(auto& f: frames)
+                if(f.automatic)
+                    autos.push_back(&f);
+
+            /* Each luma is used both for the frame itself
+             * and for the frame that follows it.
+             */
+            #pragma omp parallel for schedule(dynamic)
+            for(unsigned a=0; a<autos.size(); ++a)
+                autos[a]->luma.Load(&autos[a]->pixels[0], autos[a]->sx, autos[a]->sy);
+
+            #pragma omp parallel for schedule(dynamic)
+            for(unsigned a=0; a<autos.size(); ++a)
+            {
+                InputFrame&            f         = *autos[a];
+                const VecType<uint32>& prev      = a ? autos[a-1]->pixels : last_auto;
+                const FrameLuma&       prev_luma = a ? autos[a-1]->luma   : last_auto_luma;
+                f.align.offs_x = f.align.offs_y = 0;
+                f.align.suspect_reset = true;
+                if(prev.size() == f.sx*f.sy)
+                    f.align = tracker.TryAlignWithPrevFrame(&prev[0], &f.pixels[0], f.sx,f.sy,
+                                                            &prev_luma, &f.luma);
+            }
+        }
+
+        VecType<uint32>* latest      = &last;
+        VecType<uint32>* latest_auto = &last_auto;
+        FrameLuma*       latest_luma = &last_auto_luma;
+        for(auto& f: frames)
+        {
+            if(f.repeat)
+                // latest still holds the masked previous frame
+                tracker.RepeatScreen(&(*latest)[0], f.sx,f.sy);
+            else if(f.forced || !autoalign)
+                tracker.FitScreen(&f.pixels[0], f.sx,f.sy, f.align);
+            else if(batch)
+                tracker.FitScreenAutomatic(&f.pixels[0], f.sx,f.sy, f.align, &f.luma);
+            else
+                tracker.FitScreenAutomatic(&f.pixels[0], f.sx,f.sy);
+
+            if(!f.repeat)  latest      = &f.pixels;
+            if(f.automatic) { latest_auto = &f.pixels; latest_luma = &f.luma; }
+            tracker.NextFrame();
+        }
+        if(latest_luma != &last_auto_luma) last_auto_luma.swap(*latest_luma);
+        if(latest_auto != &last_auto) last_auto.swap(*latest_auto);
+        if(latest == latest_auto)     last = last_auto;
+        else if(latest != &last)      last.swap(*latest);
+        frames.clear();
+    }
+
     int ParsePixelMethod(
         char* optarg,
         bool allow_multiple,
@@ -98,6 +186,15 @@ namespace
         }
         return result;
     }
+
+    /* FNV-1a hash of the frame contents */
+    uint64 HashFrame(const uint32* pixels, unsigned count)
+    {
+        uint64 hash = 14695981039346656037ull;
+        for(unsigned a=0; a<count; ++a)
+            hash = (hash ^ pixels[a]) * 1099511628211ull;
+        return hash;
+    }
 } // namespace
 
 static const struct option long_options[] =
@@ -123,6 +220,9 @@ static const struct option long_options[] =
     {"noalign",    0,0,4002},
     {"nofastalign",0,0,4003},
     {"forcealign", 1,0,4004},
+    {"phasealign", 0,0,4005},
+    {"batchalign", 1,0,4006},
+    {"widealign",  0,0,4007},
     {"quantize",   1,0,'Q'},
     {"dithmethod", 1,0,'D'},
     {"ditherror",  1,0,5001},  {"de",1,0,5001},
@@ -337,6 +437,22 @@ Image aligning options:\n";
      detects that the last frame would probably work as a good and fast\n\
      reference frame.\n";
                 if(v>=1)O << "\
+ --phasealign\n\
+     Find the motion between frames by phase correlation instead of\n\
+     testing candidate positions. It takes the same time no matter how\n\
+     fast the screen scrolls, so it suits fast-scrolling content where\n\
+     the default search may miss the motion.\n";
+                if(v>=2)O << "\
+ --batchalign <n>\n\
+     Decode n frames at a time, and align each of them against its previous\n\
+     frame in parallel before putting them on the canvas. Frames that do not\n\
+     align with their previous frame are aligned with the canvas as usual.\n\
+     Default: 1 (off)\n";
+                if(v>=2)O << "\
+ --widealign\n\
+     When a frame cannot be aligned with the canvas within the limits of\n\
+     --mvrange, search for it in the whole canvas, ignoring the limits.\n";
+                if(v>=1)O << "\
  --forcealign <frame>[-<frame2>][,<...>]=<xoffset>,<yoffset>\n\
      Override automatic alignment. You can force the given frame(s)\n\
      placed at the particular offset, relative to the previous frame.\n";
@@ -446,6 +562,10 @@ AVAILABLE PIXEL TYPES\n\
      Produces a single image. Each pixel\n\
      records the color that most often occured in that location.\n\
      Use this option for making maps!\n\
+  TINYMOSTUSED, long option: --method=tinymostused, short option: -pM\n\
+     An approximate version of \"mostused\" that uses a fixed\n\
+     amount of memory per pixel, no matter how many colors it sees.\n\
+     A color seen in more than half of the frames is always chosen.\n\
   LEASTUSED, long option: --method=leastused, short option: -pe\n\
      Produces a single image. Each pixel\n\
      records the color that least commonly occured in that location.\n\
@@ -1199,6 +1319,29 @@ rate.\n\
                     }
                     break;
                 }
+                case 4005: // phasealign
+                {
+                    use_phase_correlation = true;
+                    break;
+                }
+                case 4006: // batchalign
+                {
+                    char* arg = optarg;
+                    long tmp = strtol(arg, 0, 10);
+                    align_batch = tmp;
+                    if(align_batch < 1 || tmp != align_batch)
+                    {
+                        std::fprintf(stderr, "animmerger: Bad alignment batch size: %ld\n", tmp);
+                        opt_exit = true; exit_code = 1;
+                        align_batch = 1;
+                    }
+                    break;
+                }
+                case 4007: // widealign
+                {
+                    wide_hotspot_search = true;
+                    break;
+                }
 
                 case 'D': // dithmethod, D
                 {
@@ -1787,13 +1930,26 @@ int main(int argc, char** argv)
         return 0;
     }
 
-    VecType<uint32> pixels;
+    /* The latest masked frame, and the latest automatically aligned one */
+    VecType<uint32> pixels, auto_pixels;
+    FrameLuma       auto_luma;
+
+    /* The unmasked previous frame, for recognizing repeated frames */
+    VecType<uint32> raw, prev_raw;
+    uint64 prev_hash = 0;
+    unsigned prev_sx = 0;
 
     estimated_num_frames = files.size();
 
+    const bool batch = align_batch > 1 && autoalign && !always_align_with_canvas;
+    std::vector<InputFrame> window;
+
     unsigned long framecounter = 0;
     for(auto fn: files)
     {
+        if(window.size() >= align_batch)
+            PutFrames(tracker, window, pixels, auto_pixels, auto_luma, batch);
+
         if(verbose) std::fprintf(stderr, "Reading %s\n", fn.c_str());
         FILE* fp = std::fopen(fn.c_str(), "rb");
         if(!fp)
@@ -1813,40 +1969,46 @@ int main(int argc, char** argv)
         }
 
         unsigned sx = gdImageSX(im), sy = gdImageSY(im);
-        pixels.resize(sx*sy);
+        raw.resize(sx*sy);
       #pragma omp parallel for schedule(static)
         for(unsigned y=0; y<sy; ++y)
             for(unsigned p=y*sx, x=0; x<sx; ++x)
-                pixels[p+x] = gdImageGetTrueColorPixel(im, x,y);
+                raw[p+x] = gdImageGetTrueColorPixel(im, x,y);
 
         gdImageDestroy(im);
 
-        MaskImage(pixels, sx,sy);
-
         auto i = forced_align.find(framecounter);
-        if(i != forced_align.end())
-        {
-            AlignResult align;
-            align.offs_x = i->value.first;
-            align.offs_y = i->value.second;
-            align.suspect_reset = false;
-            tracker.FitScreen(&pixels[0], sx,sy, align);
-        }
-        else if(autoalign)
-        {
-            tracker.FitScreenAutomatic(&pixels[0], sx,sy);
-        }
-        else
-        {
-            AlignResult align;
-            align.offs_x = 0;
-            align.offs_y = 0;
-            align.suspect_reset = false;
-            tracker.FitScreen(&pixels[0], sx,sy, align);
-        }
 
-        tracker.NextFrame();
+        window.resize(window.size()+1);
+        InputFrame& frame = window.back();
+        frame.sx        = sx;
+        frame.sy        = sy;
+        frame.forced    = i != forced_align.end();
+        frame.automatic = false;
+        frame.align.offs_x = frame.forced ? i->value.first  : 0;
+        frame.align.offs_y = frame.forced ? i->value.second : 0;
+        frame.align.suspect_reset = false;
         ++framecounter;
+
+        /* Captures often repeat the same frame many times (pauses,
+         * menus, lag frames). Such a frame would align to where the
+         * previous one did, so it is only recorded at the same spot.
+         */
+        uint64 hash = HashFrame(&raw[0], raw.size());
+        frame.repeat = framecounter > 1 && hash == prev_hash
+                    && sx == prev_sx && raw.size() == prev_raw.size()
+                    && !frame.forced
+                    && std::memcmp(&raw[0], &prev_raw[0], raw.size()*sizeof(uint32)) == 0;
+        if(frame.repeat) continue;
+
+        prev_hash = hash;
+        prev_sx   = sx;
+        frame.pixels = raw;
+        prev_raw.swap(raw);
+
+        MaskImage(frame.pixels, sx,sy);
+        frame.automatic = autoalign && !frame.forced;
     }
+    PutFrames(tracker, window, pixels, auto_pixels, auto_luma, batch);
     tracker.Save();
 }
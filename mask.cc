@@ -1,10 +1,12 @@
 #include <cmath>
 #include <vector>
+#include <cstring>
 
 #include "mask.hh"
 #include "pixel.hh"
 #include "pixels/averagepixel.hh"
 #include "openmp.hh"
+#include "arena.hh"
 
 VecType<AlphaRange> alpha_ranges;
 MaskMethod maskmethod = MaskHole;
@@ -129,7 +131,9 @@ namespace
         uint32* gfx, unsigned sx,unsigned sy,
         const AlphaRange& bounds)
     {
-        const std::vector<uint32> backup( gfx, gfx + sx*sy );
+        FrameArena::Scope scratch;
+        uint32* const backup = FrameArena::Alloc<uint32>(sx*sy);
+        std::memcpy(backup, gfx, sx*sy * sizeof(uint32));
 
         /* Remove the HUD */
         #pragma omp parallel for schedule(static)
@@ -139,7 +143,7 @@ namespace
             for(unsigned x=0; x < bounds.width; ++x)
             {
                 if(is_masked_pixel( backup[q+x] ))
-                    gfx[q+x] = DecideBlurHUD(&backup[0], sx,sy,bounds, x,y);
+                    gfx[q+x] = DecideBlurHUD(backup, sx,sy,bounds, x,y);
             } // for x
         } // for y
     } // BlurHUD
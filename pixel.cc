@@ -1,3 +1,7 @@
+#include <vector>
+#include <algorithm>
+#include <cstring> // std::memset
+
 #include "types.hh"
 
 bool     OptimizeChangeLog   = true;
@@ -16,12 +20,15 @@ enum PixelMethod bgmethod  = pm_MostUsedPixel;
 enum PixelMethod bgmethod0 = pm_MostUsedPixel;
 enum PixelMethod bgmethod1 = pm_MostUsedPixel;
 
-#define DO_VERY_SPECIALIZED -1
-/* Specialization values:
+#ifndef DO_VERY_SPECIALIZED
+# define DO_VERY_SPECIALIZED -1
+#endif
+/* Specialization values (e.g. make CPPFLAGS+=-DDO_VERY_SPECIALIZED=1):
  *   1 = Specialized implementations for all Array256x256 methods
  *   0 = Specialized implementations only for those pixelmethods
- *       that have one feature
- *  -1 = Minimal set of virtual functions that still does the work
+ *       that have one feature, row kernels for the rest
+ *  -1 = Minimal set of virtual functions that still does the work;
+ *       sections are rendered with row kernels (see RowKernels)
  *  -2 = Use GetLive to implement GetStatic, further reducing code size
  */
 template<typename T>
@@ -39,6 +46,7 @@ struct Array256x256of;
     callback(TinyAverage) \
     callback(Average) \
     callback(MostUsed) \
+    callback(TinyMostUsed) \
     callback(ChangeLog)
 
 #define MakeEnum(name) impl_##name,
@@ -51,8 +59,13 @@ enum PixelMethodImpl { DefinePixelImpls(MakeEnum) };
 #include "pixels/averagepixel.hh"
 #include "pixels/tinyaveragepixel.hh"
 #include "pixels/mostusedpixel.hh"
+#include "pixels/tinymostusedpixel.hh"
 #include "pixels/changelogpixel.hh"
 
+/* These have tile layouts of their own (see pixels/averagetiles.hh) */
+template<> struct Array256x256of<AveragePixel>;
+template<> struct Array256x256of<TinyAveragePixel>;
+
 /* Count them into NPixelImpls */
 #define CountImpls(name) +1
 enum { NPixelImpls = 0 DefinePixelImpls(CountImpls) };
@@ -466,6 +479,19 @@ void Array256x256of_Base::GetLiveSectionInto
     }
 }
 
+void Array256x256of_Base::GetLiveSectionsInto
+    (unsigned long methods, unsigned timer,
+    uint32* const* targets, unsigned target_stride,
+    unsigned x1, unsigned y1,
+    unsigned width, unsigned height) const
+{
+    for(unsigned m=0; m<NPixelMethods; ++m)
+        if(methods & (1ul << m))
+            GetLiveSectionInto( (PixelMethod) m, timer,
+                targets[m], target_stride,
+                x1,y1, width,height);
+}
+
 void Array256x256of_Base::GetStaticSectionInto
     (uint32* target, unsigned target_stride,
     unsigned x1, unsigned y1,
@@ -499,10 +525,362 @@ void Array256x256of_Base::PutSectionInto
         }
 }
 
+bool Array256x256of_Base::RepeatSectionInto
+    (unsigned timer,
+    const uint32* source, unsigned target_stride,
+    unsigned x1, unsigned y1,
+    unsigned width, unsigned height)
+{
+    PutSectionInto(timer, source, target_stride, x1,y1, width,height);
+    return true;
+}
+
+void Array256x256of_Base::GetLoopingInto
+    (PixelMethod method, uint32* target) const
+{
+    for(unsigned frame=0; frame<LoopingLogLength; ++frame)
+        GetLiveSectionInto(method, frame,
+            target + frame*256*256, 256,
+            0,0, 256,256);
+}
+
+void Array256x256of_Base::Freeze(FrozenTile& target, unsigned long methods) const
+{
+    target.Clear();
+    uint32* images[NPixelMethods] = { 0 };
+    unsigned long static_methods = methods & ~AnimatedPixelMethodsMask;
+    for(unsigned m=0; m<NPixelMethods; ++m)
+    {
+        if(!(methods & (1ul << m))) continue;
+        if((1ul << m) & LoopingPixelMethodsMask)
+        {
+            target.images[m].resize(LoopingLogLength * 256*256);
+            GetLoopingInto( (PixelMethod) m, &target.images[m][0]);
+        }
+        else if(static_methods & (1ul << m))
+        {
+            target.images[m].resize(256*256);
+            images[m] = &target.images[m][0];
+        }
+    }
+    /* All the non-animated methods in one pass over the pixels */
+    if(static_methods)
+        GetLiveSectionsInto(static_methods, 0, images, 256, 0,0, 256,256);
+    target.frozen = true;
+}
+
+void FrozenTile::Clear()
+{
+    for(unsigned m=0; m<NPixelMethods; ++m)
+        images[m].clear();
+    event_begin.clear();
+    event_time.clear();
+    event_value.clear();
+    changelog_before.clear();
+    changelog_after.clear();
+    frame.clear();
+    cursor.clear();
+    trails.clear();
+    frame_method = -1;
+    frozen = false;
+}
+
+const uint32* FrozenTile::Render(PixelMethod method, unsigned timer)
+{
+    if(!frozen) return 0;
+    if(!images[method].empty())
+    {
+        if((1ul << method) & LoopingPixelMethodsMask)
+            return &images[method][(timer % LoopingLogLength) * 256*256];
+        return &images[method][0];
+    }
+    if(method == pm_ChangeLogPixel && !event_begin.empty())
+    {
+        if(frame_method != method || frame_timer != timer)
+        {
+            /* Consecutive frames continue from where the previous one
+             * left off, both in the histories and in the blur window.
+             */
+            bool restart = frame_method != method || frame_timer+1 != timer;
+            RenderChangeLog(timer, restart);
+            frame_method = method;
+            frame_timer  = timer;
+        }
+        return &frame[0];
+    }
+    return 0;
+}
+
+void FrozenTile::RenderChangeLog(unsigned timer, bool restart)
+{
+    /* Equivalent to ChangeLogPixel::GetChangeLog(), but reading
+     * the flattened histories. cursor[n] is the position of the
+     * first event of pixel n that comes after timer.
+     * For motion blur, trails[n] remembers the latest value
+     * other than the background within the blur window, which is
+     * all that GetChangeLog's walk backwards would observe.
+     * Histories never contain transparent pixels, so Uncovered
+     * tells apart the timers not covered by a history.
+     */
+    const uint32 Uncovered = 0xFFFFFFFFu;
+    frame.resize(256*256);
+    cursor.resize(256*256);
+    if(AnimationBlurLength != 0) trails.resize(256*256);
+
+    const unsigned* const times  = event_time.begin();
+    const uint32*   const values = event_value.begin();
+
+    struct Lookup
+    {
+        /* ChangeLogPixel::Find() on the flattened history */
+        static inline uint32 Find(const unsigned* times, const uint32* values,
+                                  unsigned begin, unsigned end, unsigned pos,
+                                  unsigned timer, uint32 before, uint32 after)
+        {
+            if(!OptimizeChangeLog)
+                return (pos > begin && times[pos-1] == timer) ? values[pos-1] : before;
+            if(pos == begin) return before;
+            if(pos == end && times[pos-1] < timer) return after;
+            return values[pos-1];
+        }
+    };
+
+    #pragma omp parallel for schedule(static)
+    for(int index=0; index<256*256; ++index)
+    {
+        const unsigned begin = event_begin[index], end = event_begin[index+1];
+        unsigned& pos = cursor[index];
+        if(restart)
+            pos = std::upper_bound(times+begin, times+end, timer) - times;
+        else
+            while(pos < end && times[pos] <= timer) ++pos;
+
+        const uint32 before = changelog_before[index];
+        if(AnimationBlurLength == 0)
+        {
+            frame[index] = Lookup::Find(times,values, begin,end,pos,
+                                        timer, before, changelog_after[index]);
+            continue;
+        }
+
+        ChangeLogTrail& trail = trails[index];
+        if(restart)
+        {
+            trail.most = before;
+            trail.time = ~0u;
+            for(unsigned t = timer > AnimationBlurLength
+                           ? timer - AnimationBlurLength : 0;
+                t < timer; ++t)
+            {
+                unsigned p = std::upper_bound(times+begin, times+end, t) - times;
+                uint32 pix = Lookup::Find(times,values, begin,end,p,
+                                          t, Uncovered, Uncovered);
+                if(pix != Uncovered && pix != trail.most)
+                    { trail.value = pix; trail.time = t; }
+            }
+        }
+
+        uint32 pix = Lookup::Find(times,values, begin,end,pos,
+                                  timer, Uncovered, Uncovered), res = pix;
+        if(pix == Uncovered || pix == DefaultPixel)
+        {
+            AveragePixel result;
+            result.set_n(DefaultPixel, 1);
+            bool found = trail.time != ~0u
+                      && timer - trail.time <= AnimationBlurLength;
+            unsigned n_most = found ? timer - trail.time - 1
+                                    : std::min(timer, AnimationBlurLength);
+            if(AveragesInYUV)
+                // Float sums: add them one by one, like GetChangeLog() does
+                for(unsigned n=0; n<n_most; ++n)
+                    result.set_n(trail.most, 1);
+            else
+                result.set_n(trail.most, n_most);
+            if(found)
+                result.set_n(trail.value, 1);
+            res = result.get();
+        }
+        frame[index] = res;
+
+        // This frame enters the blur window of the next one
+        if(pix != Uncovered && pix != trail.most)
+            { trail.value = pix; trail.time = timer; }
+    }
+}
+
+namespace
+{
+    /* Renders all frames of a looping method in one pass
+     * per pixel. Only available when T contains ChangeLogPixel,
+     * which is the only implementer of the looping methods.
+     */
+    template<typename T,
+             bool HasLooping = PixelMetaInfo<T>::Traits
+                             & (1ul << pm_LoopingLogPixel)>
+    struct LoopingRenderer
+    {
+        static bool Render(const T* data, PixelMethod method, uint32* target)
+        {
+            switch(method)
+            {
+                case pm_LoopingAvgPixel:
+                    Run<ChangeLogPixel::LoopingAvgSlave<AveragePixel> >(data, target);
+                    return true;
+                case pm_LoopingLogPixel:
+                    Run<ChangeLogPixel::LoopingLastSlave>(data, target);
+                    return true;
+                default:
+                    return false;
+            }
+        }
+    private:
+        template<typename SlaveType>
+        static void Run(const T* data, uint32* target)
+        {
+          #pragma omp parallel
+          {
+            std::vector<SlaveType> phases;
+            phases.reserve(LoopingLogLength);
+            #pragma omp for schedule(static)
+            for(int index=0; index<256*256; ++index)
+                data[index].GetLoopingAggregates(phases, target+index, 256*256);
+          }
+        }
+    };
+    template<typename T>
+    struct LoopingRenderer<T, false>
+    {
+        static bool Render(const T*, PixelMethod, uint32*)
+        {
+            return false;
+        }
+    };
+
+    /* Flattens the ChangeLog histories into a FrozenTile.
+     * Only available when T contains ChangeLogPixel.
+     */
+    template<typename T,
+             bool HasChangeLog = PixelMetaInfo<T>::Traits
+                               & (1ul << pm_ChangeLogPixel)>
+    struct ChangeLogFreezer
+    {
+        static void Freeze(const T* data, FrozenTile& target)
+        {
+            target.event_begin.resize(256*256+1);
+            unsigned n_events = 0;
+            for(unsigned index=0; index<256*256; ++index)
+            {
+                target.event_begin[index] = n_events;
+                n_events += data[index].GetHistory().size();
+            }
+            target.event_begin[256*256] = n_events;
+            target.event_time.resize(n_events);
+            target.event_value.resize(n_events);
+            target.changelog_before.resize(256*256);
+            target.changelog_after.resize(256*256);
+
+            #pragma omp parallel for schedule(static)
+            for(int index=0; index<256*256; ++index)
+            {
+                const ChangeLogPixel& pix = data[index];
+                unsigned pos = target.event_begin[index];
+                for(MapType<unsigned, uint32>::const_iterator
+                    i = pix.GetHistory().begin();
+                    i != pix.GetHistory().end();
+                    ++i, ++pos)
+                {
+                    target.event_time[pos]  = i->first;
+                    target.event_value[pos] = i->second;
+                }
+                target.changelog_before[index] = pix.GetChangeLogBackground(-1);
+                target.changelog_after[index]  = pix.GetChangeLogBackground(+1);
+            }
+        }
+    };
+    template<typename T>
+    struct ChangeLogFreezer<T, false>
+    {
+        static void Freeze(const T*, FrozenTile&)
+        {
+        }
+    };
+}
+
+namespace
+{
+    /* Calls Get<method>() by method number */
+    template<int method> struct CallGetMethod { };
+    #define MakeMethodGetter(o,f,name) \
+    template<> struct CallGetMethod<pm_##name##Pixel> \
+    { \
+        template<typename T> \
+        static inline uint32 call(const T& obj, unsigned timer) \
+        { \
+            return CallGet##name(obj, timer); \
+        } \
+    };
+    DefinePixelMethods(MakeMethodGetter)
+    #undef MakeMethodGetter
+
+    /* An inlined row kernel for each pixel method of T.
+     * Find() is done once per section, so that the rendering
+     * does not go through GetLive() and a switch for every pixel.
+     * Only the methods that T implements get a kernel of their own;
+     * like in DoGetLive(), the rest use the first one that T has.
+     */
+    template<typename T>
+    struct RowKernels
+    {
+        typedef void (*KernelType)(const T* source, unsigned timer,
+                                   uint32* target, unsigned width);
+
+        static const unsigned long Traits = PixelMetaInfo<T>::Traits;
+        static const PixelMethod FirstMethod
+            = (PixelMethod) GetLowestBit<Traits>::result;
+
+        template<int method>
+        struct Effective
+        {
+            enum { result = (Traits & (1ul << method)) ? method : (int)FirstMethod };
+        };
+
+        template<int method>
+        static void Row(const T* source, unsigned timer,
+                        uint32* target, unsigned width)
+        {
+            for(unsigned x=0; x<width; ++x)
+                target[x] = CallGetMethod<method>::call(source[x], timer);
+        }
+
+        static KernelType Find(PixelMethod method)
+        {
+            #define MakeKernelEntry(o,f,name) \
+                &Row<Effective<pm_##name##Pixel>::result>,
+            static const KernelType table[NPixelMethods] =
+            {
+                DefinePixelMethods(MakeKernelEntry)
+            };
+            #undef MakeKernelEntry
+            if((unsigned)method >= NPixelMethods) method = FirstMethod;
+            return table[method];
+        }
+
+        static void Render(PixelMethod method, unsigned timer,
+            const T* source,
+            uint32* target, unsigned target_stride,
+            unsigned width, unsigned height)
+        {
+            const KernelType kernel = Find(method);
+            for(; height-- > 0; source += 256, target += target_stride)
+                kernel(source, timer, target, width);
+        }
+    };
+}
+
 template<typename T,
     bool ManyImpl =
 #if DO_VERY_SPECIALIZED == 0
-(PopCount<T::Traits>::result > 1)
+(PopCount<PixelMetaInfo<T>::Traits>::result > 1)
 #else
     false
 #endif
@@ -511,6 +889,33 @@ struct Array256x256ofImpl: public Array256x256of_Base
 {
 public:
     T data[256*256];
+
+#if DO_VERY_SPECIALIZED >= -1
+    virtual void GetLiveSectionInto(PixelMethod method, unsigned timer,
+        uint32* target, unsigned target_stride,
+        unsigned x1, unsigned y1,
+        unsigned width, unsigned height) const FastPixelMethod
+    {
+        RowKernels<T>::Render(method, timer, data + (y1*256+x1),
+                              target, target_stride, width, height);
+    }
+
+    virtual void GetStaticSectionInto(
+        uint32* target, unsigned target_stride,
+        unsigned x1, unsigned y1,
+        unsigned width, unsigned height) const FastPixelMethod
+    {
+        RowKernels<T>::Render(bgmethod, 0, data + (y1*256+x1),
+                              target, target_stride, width, height);
+    }
+
+    virtual void GetStaticInto(
+        uint32* target, unsigned target_stride) const FastPixelMethod
+    {
+        RowKernels<T>::Render(bgmethod, 0, data,
+                              target, target_stride, 256, 256);
+    }
+#endif
 };
 
 #if DO_VERY_SPECIALIZED >= 0
@@ -530,7 +935,7 @@ public:
     #if DO_VERY_SPECIALIZED>0
         #define MakeMethodCase(n,f,name) \
             case pm_##name##Pixel: \
-                if(T::Traits & (1ul<<pm_##name##Pixel)) \
+                if(PixelMetaInfo<T>::Traits & (1ul<<pm_##name##Pixel)) \
                     for(; databegin<dataend; \
                            target += target_stride-width, \
                            databegin += 256-width) \
@@ -564,7 +969,7 @@ public:
     #if DO_VERY_SPECIALIZED>0
         #define MakeMethodCase(n,f,name) \
             case pm_##name##Pixel: \
-                if(T::Traits & (1ul<<pm_##name##Pixel)) \
+                if(PixelMetaInfo<T>::Traits & (1ul<<pm_##name##Pixel)) \
                     for(; databegin<dataend; \
                            target += target_stride-width, \
                            databegin += 256-width) \
@@ -579,7 +984,6 @@ public:
         #undef MakeMethodCase
     #else
         // This implementation works when T only has one feature
-        method=method;
         for(; databegin<dataend;
                target += target_stride-width,
                databegin += 256-width)
@@ -596,7 +1000,7 @@ public:
     #if DO_VERY_SPECIALIZED>0
         #define MakeMethodCase(n,f,name) \
             case pm_##name##Pixel: \
-                if(T::Traits & (1ul<<pm_##name##Pixel)) \
+                if(PixelMetaInfo<T>::Traits & (1ul<<pm_##name##Pixel)) \
                     for(; databegin<dataend; \
                            target += target_stride-256) \
                         for(unsigned x=256; x-->0; ) \
@@ -658,6 +1062,61 @@ public:
         rep::data[index].set(p, timer);
     }
 
+    virtual bool RepeatSectionInto(unsigned timer,
+        const uint32* source, unsigned target_stride,
+        unsigned x1, unsigned y1,
+        unsigned width, unsigned height) FastPixelMethod
+    {
+        /* First and Last do not change when they see the same value again */
+        const unsigned IdempotentComponents = (1u << impl_First) | (1u << impl_Last);
+        if(!(PixelMetaInfo<T>::Components & ~IdempotentComponents))
+            return false;
+        return Array256x256of_Base::RepeatSectionInto(
+            timer, source, target_stride, x1,y1, width,height);
+    }
+
+    virtual void GetLiveSectionsInto(unsigned long methods, unsigned timer,
+        uint32* const* targets, unsigned target_stride,
+        unsigned x1, unsigned y1,
+        unsigned width, unsigned height) const FastPixelMethod
+    {
+        PixelMethod list[NPixelMethods];
+        unsigned nmethods = 0;
+        for(unsigned m=0; m<NPixelMethods; ++m)
+            if(methods & (1ul << m))
+                list[nmethods++] = (PixelMethod) m;
+        if(nmethods == 1)
+        {
+            this->GetLiveSectionInto(list[0], timer,
+                targets[list[0]], target_stride, x1,y1, width,height);
+            return;
+        }
+
+        typename RowKernels<T>::KernelType kernels[NPixelMethods];
+        for(unsigned k=0; k<nmethods; ++k)
+            kernels[k] = RowKernels<T>::Find(list[k]);
+
+        /* Row by row, so that each row is still in cache
+         * when the next method reads it */
+        unsigned p=0, index=y1*256+x1, maxindex=index+height*256;
+        for(; index<maxindex; p+=target_stride, index+=256)
+            for(unsigned k=0; k<nmethods; ++k)
+                kernels[k](rep::data + index, timer, targets[list[k]] + p, width);
+    }
+
+    virtual void GetLoopingInto(PixelMethod method, uint32* target) const FastPixelMethod
+    {
+        if(!LoopingRenderer<T>::Render(rep::data, method, target))
+            Array256x256of_Base::GetLoopingInto(method, target);
+    }
+
+    virtual void Freeze(FrozenTile& target, unsigned long methods) const FastPixelMethod
+    {
+        Array256x256of_Base::Freeze(target, methods);
+        if(methods & (1ul << pm_ChangeLogPixel))
+            ChangeLogFreezer<T>::Freeze(rep::data, target);
+    }
+
 private:
     uint32 DoGetLive(PixelMethod method, unsigned index, unsigned timer) const FastPixelMethod
     {
@@ -695,6 +1154,8 @@ private:
     }
 };
 
+#include "pixels/averagetiles.hh"
+
 void UncertainPixelVector256x256::init()
 {
     /* Construct the type of object determined by the globals "pixelmethod" and "bgmethod" */
@@ -2,6 +2,7 @@
 #define bqtTileTrackerPixelHH
 
 #include "types.hh"
+#include "vectype.hh"
 
 /* This is the definite list of available pixel methods. */
 /* The order is completely arbitrary and irrelevant.
@@ -25,7 +26,8 @@
     callback(e,0x00,LeastUsed) \
     callback(c,0x05,ChangeLog) \
     callback(v,0x17,LoopingAvg) \
-    callback(o,0x07,LoopingLog)
+    callback(o,0x07,LoopingLog) \
+    callback(M,0x00,TinyMostUsed)
 
 /* Create it as an enum */
 #define MakeEnum(o,f,name) pm_##name##Pixel,
@@ -81,6 +83,70 @@ static const unsigned long YUVCapablePixelMethodsMask = 0 DefinePixelMethods(Mak
 # define FasterPixelMethod
 #endif
 
+/* Row kernels that benefit from wider vectors are compiled
+ * for several instruction sets; the best one is picked at runtime.
+ * This requires ifunc support, which only ELF platforms have.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 6 \
+ && defined(__x86_64__) && defined(__ELF__)
+# define VectorizedKernel __attribute__((target_clones("avx2","sse4.2","default")))
+#else
+# define VectorizedKernel
+#endif
+
+
+/* Running state for rendering the motion-blurred ChangeLog
+ * of consecutive frames (see FrozenTile::RenderChangeLog).
+ */
+struct ChangeLogTrail
+{
+    uint32   most;  // The background, GetChangeLogBackground()
+    uint32   value; // Latest non-background value before timer
+    unsigned time;  // Timer of that value, ~0u if none
+};
+
+/* Read-only form of a 256x256 tile, made once the input is over
+ * (see TILE_Tracker::Freeze). It holds the rendered image of each
+ * non-animated method, every frame of the looping methods, and
+ * the flattened ChangeLog history with its backgrounds, so that
+ * saving no longer consults the accumulation structures.
+ */
+class FrozenTile
+{
+public:
+    bool frozen;
+
+    // One 256x256 image for each non-animated method,
+    // LoopingLogLength images for each looping method.
+    VecType<uint32> images[NPixelMethods];
+
+    // The ChangeLog history of pixel n is found in
+    // event_time/event_value [event_begin[n] .. event_begin[n+1]-1].
+    VecType<unsigned> event_begin;
+    VecType<unsigned> event_time;
+    VecType<uint32>   event_value;
+    VecType<uint32>   changelog_before; // GetChangeLogBackground(-1)
+    VecType<uint32>   changelog_after;  // GetChangeLogBackground(+1)
+
+    FrozenTile() : frozen(false), frame_method(-1), frame_timer(0) { }
+
+    /* Returns 256x256 pixels of the given method at the given timer,
+     * or NULL if the tile was not frozen with that method.
+     * The pointer is valid until the next call.
+     */
+    const uint32* Render(PixelMethod method, unsigned timer);
+
+    void Clear();
+
+private:
+    void RenderChangeLog(unsigned timer, bool restart);
+
+    VecType<uint32>         frame;
+    int                     frame_method;
+    unsigned                frame_timer;
+    VecType<unsigned>       cursor;
+    VecType<ChangeLogTrail> trails;
+};
 
 /* A vector of 256x256 pixels. */
 /* Each pixel has two traits:
@@ -105,6 +171,16 @@ struct Array256x256of_Base
         unsigned x1, unsigned y1,
         unsigned width, unsigned height) const FastPixelMethod;
 
+    /* Same as GetLiveSectionInto for every method in the bitmask,
+     * reading each pixel only once. The section of method m goes
+     * into targets[m].
+     */
+    virtual void GetLiveSectionsInto
+        (unsigned long methods, unsigned timer,
+        uint32* const* targets, unsigned target_stride,
+        unsigned x1, unsigned y1,
+        unsigned width, unsigned height) const FastPixelMethod;
+
     virtual void GetStaticSectionInto
         (uint32* target, unsigned target_stride,
         unsigned x1, unsigned y1,
@@ -115,6 +191,26 @@ struct Array256x256of_Base
         const uint32* source, unsigned target_stride,
         unsigned x1, unsigned y1,
         unsigned width, unsigned height) FastPixelMethod;
+
+    /* Writes again the same section as the previous PutSectionInto,
+     * at a later timer. Returns false if that changed nothing.
+     */
+    virtual bool RepeatSectionInto
+        (unsigned timer,
+        const uint32* source, unsigned target_stride,
+        unsigned x1, unsigned y1,
+        unsigned width, unsigned height) FastPixelMethod;
+
+    /* Renders every frame (0..LoopingLogLength-1) of a looping
+     * pixel method at once. Frame n goes into target[n*256*256].
+     */
+    virtual void GetLoopingInto
+        (PixelMethod method, uint32* target) const FastPixelMethod;
+
+    /* Fills the read-only form of this tile for the
+     * pixel methods given as a bitmask (see pixelmethods_result).
+     */
+    virtual void Freeze(FrozenTile& target, unsigned long methods) const FastPixelMethod;
 };
 class UncertainPixelVector256x256
 {
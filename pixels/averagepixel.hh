@@ -65,39 +65,65 @@ public:
     {
         if(!n) return DefaultPixel;
         if(AveragesInYUV)
-        {
-            using namespace AvgYUV;
-            double invN = 1.0 / n;
-            double Y = double(y)*invN, U = double(u)*invN, V = double(v)*invN;
-            int r=0,g=0,b=0;
-            for(int run=0; run<1000; ++run)
-            {
-                r = (int)( /*0.5 +*/ 255.0*(Y + V * (   (1-Wr)/(Vmax   ))));
-                g = (int)( /*0.5 +*/ 255.0*(Y - U * (Wb*(1-Wb)/(Umax*Wg))
-                                              - V * (Wr*(1-Wr)/(Vmax*Wg))
-                         )             );
-                b = (int)( /*0.5 +*/ 255.0*(Y + U * (   (1-Wb)/(Umax   ))));
-                if(r>=0 && r<=255
-                && g>=0 && g<=255
-                && b>=0 && b<=255)
-                {
-                    return (((r) << 16) + ((g) << 8) + (b));
-                }
-                /* In case of overflow, reduce chroma but keep luma unchanged */
-                U *= 0.99;
-                V *= 0.99;
-            }
-            if(r<0) { r=0; } if(r>255) { r=255; }
-            if(g<0) { g=0; } if(g>255) { g=255; }
-            if(b<0) { b=0; } if(b>255) { b=255; }
-            return (((r) << 16) + ((g) << 8) + (b));
-        }
+            return ResolveYUV(y,u,v, n);
         else
-        {
-            return ((((r+n/2)/n) << 16) + (((g+n/2)/n) << 8) + ((b+n/2)/n));
-        }
+            return ResolveRGB(r,g,b, n);
+    }
+
+    /* Converts the sums into a pixel value. n must not be 0. */
+    static inline uint32 ResolveRGB(unsigned r,unsigned g,unsigned b, unsigned n)
+    {
+        return ((((r+n/2)/n) << 16) + (((g+n/2)/n) << 8) + ((b+n/2)/n));
+    }
+
+    static inline uint32 ResolveYUV(float y,float u,float v, unsigned n) FasterPixelMethod
+    {
+        using namespace AvgYUV;
+        double invN = 1.0 / n;
+        double Y = double(y)*invN, U = double(u)*invN, V = double(v)*invN;
+        int r,g,b;
+        YUVtoRGB(Y,U,V, r,g,b);
+
+        /* In case of overflow, reduce chroma but keep luma unchanged.
+         * Each channel is linear in the chroma scale, so the largest
+         * scale that brings the color into gamut is solved directly.
+         * This is branch-free so that it can be vectorized.
+         */
+        double s = 1.0, lim;
+        lim = ChromaLimit(r, Y, V * ((1-Wr)/Vmax));                 s = lim < s ? lim : s;
+        lim = ChromaLimit(g, Y, - U * (Wb*(1-Wb)/(Umax*Wg))
+                                - V * (Wr*(1-Wr)/(Vmax*Wg)));       s = lim < s ? lim : s;
+        lim = ChromaLimit(b, Y, U * ((1-Wb)/Umax));                 s = lim < s ? lim : s;
+        s = s > 0.0 ? s : 0.0;
+        YUVtoRGB(Y,U*s,V*s, r,g,b); // Identical to the above when s = 1
+
+        r = r<0 ? 0 : r>255 ? 255 : r;
+        g = g<0 ? 0 : g>255 ? 255 : g;
+        b = b<0 ? 0 : b>255 ? 255 : b;
+        return (((r) << 16) + ((g) << 8) + (b));
+    }
+
+private:
+    static inline void YUVtoRGB(double Y,double U,double V, int& r,int& g,int& b) FasterPixelMethod
+    {
+        using namespace AvgYUV;
+        r = (int)( /*0.5 +*/ 255.0*(Y + V * (   (1-Wr)/(Vmax   ))));
+        g = (int)( /*0.5 +*/ 255.0*(Y - U * (Wb*(1-Wb)/(Umax*Wg))
+                                      - V * (Wr*(1-Wr)/(Vmax*Wg))
+                 )             );
+        b = (int)( /*0.5 +*/ 255.0*(Y + U * (   (1-Wb)/(Umax   ))));
     }
 
+    /* Largest chroma scale for which the channel c = 255*(Y + C)
+     * stays within 0..255. Returns 1 when c already does.
+     */
+    static inline double ChromaLimit(int c, double Y, double C) FasterPixelMethod
+    {
+        bool ok = (c >= 0 && c <= 255) || C == 0.0;
+        return ok ? 1.0 : ((C > 0.0 ? 1.0 : 0.0) - Y) / (ok ? 1.0 : C);
+    }
+
+public:
 /////////
     static const unsigned SizePenalty = 0;
 };
@@ -0,0 +1,270 @@
+/* Structure-of-arrays layouts for tiles of AveragePixel
+ * and TinyAveragePixel. Instead of 65536 interleaved pixel
+ * objects, each field is kept in an array of its own, so that
+ * whole rows can be accumulated and resolved with SIMD
+ * instructions. Transparent pixels are handled with a mask
+ * rather than a branch. The results are identical to those
+ * of the pixel classes themselves.
+ */
+
+namespace
+{
+    /* Unsigned division that the compiler can vectorize:
+     * the quotient is estimated with doubles and then corrected
+     * by the remainder, so it is exact for any b < 2^31.
+     */
+    inline unsigned VectorDivide(unsigned a, unsigned b) FasterPixelMethod;
+    inline unsigned VectorDivide(unsigned a, unsigned b)
+    {
+        unsigned q = (int)( double(a) / double(b) );
+        int rem = a - q*b;
+        return q - (rem < 0) + (rem >= 0 && unsigned(rem) >= b);
+    }
+}
+
+template<>
+struct Array256x256of<AveragePixel>: public Array256x256of_Base
+{
+    union { unsigned r[256*256]; float y[256*256]; };
+    union { unsigned g[256*256]; float u[256*256]; };
+    union { unsigned b[256*256]; float v[256*256]; };
+    unsigned n[256*256];
+
+public:
+    Array256x256of()
+    {
+        // All-zero bits is also 0.f, so this clears the YUV sums too
+        std::memset(r, 0, sizeof(r)); std::memset(g, 0, sizeof(g));
+        std::memset(b, 0, sizeof(b)); std::memset(n, 0, sizeof(n));
+    }
+
+    virtual uint32 GetLive(PixelMethod, unsigned index, unsigned) const FastPixelMethod
+    {
+        if(!n[index]) return DefaultPixel;
+        if(AveragesInYUV)
+            return AveragePixel::ResolveYUV(y[index],u[index],v[index], n[index]);
+        return AveragePixel::ResolveRGB(r[index],g[index],b[index], n[index]);
+    }
+
+    virtual void Set(unsigned index, uint32 p, unsigned) FastPixelMethod
+    {
+        if(AveragesInYUV)
+            AccumulateYUV(y+index,u+index,v+index, n+index, &p, 1);
+        else
+            AccumulateRGB(r+index,g+index,b+index, n+index, &p, 1);
+    }
+
+    virtual void GetStaticInto(uint32* target, unsigned target_stride) const FastPixelMethod
+    {
+        GetStaticSectionInto(target, target_stride, 0,0, 256,256);
+    }
+
+    virtual void GetLiveSectionInto(PixelMethod, unsigned,
+        uint32* target, unsigned target_stride,
+        unsigned x1, unsigned y1,
+        unsigned width, unsigned height) const FastPixelMethod
+    {
+        GetStaticSectionInto(target, target_stride, x1,y1, width,height);
+    }
+
+    virtual void GetStaticSectionInto(
+        uint32* target, unsigned target_stride,
+        unsigned x1, unsigned y1,
+        unsigned width, unsigned height) const FastPixelMethod
+    {
+        unsigned index=y1*256+x1, maxindex=index+height*256;
+        for(; index<maxindex; target+=target_stride, index+=256)
+        {
+            if(AveragesInYUV)
+                ResolveYUV(target, y+index,u+index,v+index, n+index, width);
+            else
+                ResolveRGB(target, r+index,g+index,b+index, n+index, width);
+        }
+    }
+
+    virtual void PutSectionInto
+        (unsigned,
+        const uint32* source, unsigned target_stride,
+        unsigned x1, unsigned y1,
+        unsigned width, unsigned height) FastPixelMethod
+    {
+        unsigned index=y1*256+x1, maxindex=index+height*256;
+        for(; index<maxindex; source+=target_stride, index+=256)
+            if(AveragesInYUV)
+                AccumulateYUV(y+index,u+index,v+index, n+index, source, width);
+            else
+                AccumulateRGB(r+index,g+index,b+index, n+index, source, width);
+    }
+
+private:
+    /* Row kernels. These do what AveragePixel::set_n_rgb() and
+     * AveragePixel::GetAverage() do, for "width" pixels at once.
+     */
+    static void AccumulateRGB(
+        unsigned*__restrict r, unsigned*__restrict g, unsigned*__restrict b,
+        unsigned*__restrict n, const uint32*__restrict source,
+        unsigned width) VectorizedKernel
+    {
+        for(unsigned x=0; x<width; ++x)
+        {
+            uint32 pix = source[x];
+            unsigned m = pix < 0x7F000000u; // Do not plot transparent pixels
+            r[x] += ((pix>>16)&0xFF) * m;
+            g[x] += ((pix>> 8)&0xFF) * m;
+            b[x] += ((pix    )&0xFF) * m;
+            n[x] += m;
+        }
+    }
+
+    static void AccumulateYUV(
+        float*__restrict y, float*__restrict u, float*__restrict v,
+        unsigned*__restrict n, const uint32*__restrict source,
+        unsigned width) VectorizedKernel
+    {
+        using namespace AvgYUV;
+        for(unsigned x=0; x<width; ++x)
+        {
+            uint32 pix = source[x];
+            // Signed ints, because GCC only vectorizes int->double
+            int m = pix < 0x7F000000u; // Do not plot transparent pixels
+            int R = (pix>>16)&0xFF, G = (pix>>8)&0xFF, B = pix&0xFF;
+            double Y = R*(Wr/255.0)
+                     + G*(Wg/255.0)
+                     + B*(Wb/255.0);
+            double U = (Umax/(1-(Wb))) * (B/255.0-Y);
+            double V = (Vmax/(1-(Wr))) * (R/255.0-Y);
+            double c = m;
+            y[x] += Y*c;
+            u[x] += U*c;
+            v[x] += V*c;
+            n[x] += m;
+        }
+    }
+
+    static void ResolveRGB(uint32*__restrict target,
+        const unsigned*__restrict r, const unsigned*__restrict g,
+        const unsigned*__restrict b, const unsigned*__restrict n,
+        unsigned width) VectorizedKernel
+    {
+        for(unsigned x=0; x<width; ++x)
+        {
+            unsigned count = n[x], half = count/2, d = count + !count;
+            uint32 pix = (VectorDivide(r[x]+half, d) << 16)
+                       + (VectorDivide(g[x]+half, d) << 8)
+                       + (VectorDivide(b[x]+half, d));
+            target[x] = count ? pix : DefaultPixel;
+        }
+    }
+
+    static void ResolveYUV(uint32*__restrict target,
+        const float*__restrict y, const float*__restrict u,
+        const float*__restrict v, const unsigned*__restrict n,
+        unsigned width) VectorizedKernel
+    {
+        for(unsigned x=0; x<width; ++x)
+        {
+            unsigned count = n[x];
+            uint32 pix = AveragePixel::ResolveYUV(y[x],u[x],v[x], count + !count);
+            target[x] = count ? pix : DefaultPixel;
+        }
+    }
+};
+
+template<>
+struct Array256x256of<TinyAveragePixel>: public Array256x256of_Base
+{
+    // The average, packed as in TinyAveragePixel::result
+    unsigned result[256*256];
+    unsigned n[256*256];
+
+public:
+    Array256x256of()
+    {
+        std::memset(result, 0, sizeof(result));
+        std::memset(n,      0, sizeof(n));
+    }
+
+    virtual uint32 GetLive(PixelMethod, unsigned index, unsigned) const FastPixelMethod
+    {
+        uint32 pix;
+        Resolve(&pix, result+index, n+index, 1);
+        return pix;
+    }
+
+    virtual void Set(unsigned index, uint32 p, unsigned) FastPixelMethod
+    {
+        Accumulate(result+index, n+index, &p, 1);
+    }
+
+    virtual void GetStaticInto(uint32* target, unsigned target_stride) const FastPixelMethod
+    {
+        GetStaticSectionInto(target, target_stride, 0,0, 256,256);
+    }
+
+    virtual void GetLiveSectionInto(PixelMethod, unsigned,
+        uint32* target, unsigned target_stride,
+        unsigned x1, unsigned y1,
+        unsigned width, unsigned height) const FastPixelMethod
+    {
+        GetStaticSectionInto(target, target_stride, x1,y1, width,height);
+    }
+
+    virtual void GetStaticSectionInto(
+        uint32* target, unsigned target_stride,
+        unsigned x1, unsigned y1,
+        unsigned width, unsigned height) const FastPixelMethod
+    {
+        unsigned index=y1*256+x1, maxindex=index+height*256;
+        for(; index<maxindex; target+=target_stride, index+=256)
+            Resolve(target, result+index, n+index, width);
+    }
+
+    virtual void PutSectionInto
+        (unsigned,
+        const uint32* source, unsigned target_stride,
+        unsigned x1, unsigned y1,
+        unsigned width, unsigned height) FastPixelMethod
+    {
+        unsigned index=y1*256+x1, maxindex=index+height*256;
+        for(; index<maxindex; source+=target_stride, index+=256)
+            Accumulate(result+index, n+index, source, width);
+    }
+
+private:
+    /* Row kernels. These do what TinyAveragePixel::set() and
+     * TinyAveragePixel::GetTinyAverage() do, for "width" pixels at once.
+     */
+    static void Accumulate(
+        unsigned*__restrict result, unsigned*__restrict n,
+        const uint32*__restrict source,
+        unsigned width) VectorizedKernel
+    {
+        for(unsigned x=0; x<width; ++x)
+        {
+            uint32 pix = source[x];
+            unsigned m = pix < 0x7F000000u; // Do not plot transparent pixels
+            unsigned R = (pix&0xFF0000u) >> 14, G = (pix&0xFF00u) >> 4, B = (pix&0xFFu) << 2;
+            unsigned res = result[x], count = n[x];
+            unsigned r = (res>>22)&0x3FF, g = (res>>10)&0xFFF, b = (res&0x3FF);
+            r = VectorDivide(r*count + R, count+1);
+            g = VectorDivide(g*count + G, count+1);
+            b = VectorDivide(b*count + B, count+1);
+            result[x] = m ? ((r<<22) | (g<<10) | (b<<0)) : res;
+            n[x]      = count + m;
+        }
+    }
+
+    static void Resolve(uint32*__restrict target,
+        const unsigned*__restrict result, const unsigned*__restrict n,
+        unsigned width) VectorizedKernel
+    {
+        for(unsigned x=0; x<width; ++x)
+        {
+            unsigned res = result[x];
+            uint32 pix = ((res>>24) << 16)
+                       | (((res>>14) & 0xFF) << 8)
+                       | ((res>>2) & 0xFF);
+            target[x] = n[x] ? pix : DefaultPixel;
+        }
+    }
+};
@@ -118,6 +118,11 @@ public:
         return GetChangeLog(timer);
     }
 
+    const MapType<unsigned, uint32>& GetHistory() const
+    {
+        return history;
+    }
+
     uint32 GetChangeLogOnly(unsigned timer) const FastPixelMethod
     {
         return Find(timer, DefaultPixel);
@@ -231,6 +236,70 @@ public:
         return res;
     }
 
+    template<typename SlaveType>
+    void GetLoopingAggregates(std::vector<SlaveType>& phases,
+                              uint32* target, unsigned target_stride) const
+    {
+        /* Produces GetLoopingAggregate() for every timer value
+         * 0..LoopingLogLength-1 in one walk over the history.
+         * Each history entry is distributed among the phases
+         * it covers, rather than walking the history once per
+         * phase (and once more per blur step).
+         * Result for phase n is written into target[n*target_stride].
+         */
+        const unsigned length = LoopingLogLength;
+        const uint32 most = GetMostUsed();
+
+        phases.clear();
+        for(unsigned phase=0; phase<length; ++phase)
+            phases.push_back(SlaveType(phase, most));
+
+        for(MapType<unsigned, uint32>::const_iterator
+            i = history.begin();
+            i != history.end();
+            )
+        {
+            MapType<unsigned, uint32>::const_iterator j(i); ++i;
+            if(j->second == most) continue;
+            unsigned duration =
+                (i != history.end()) ? (i->first - j->first) :
+#if CHANGELOG_USE_LASTTIMESTAMP
+                    (last_time - j->first) + 1
+#else
+                    1
+#endif
+                    ;
+            unsigned whole = duration / length;
+            unsigned rest  = duration % length;
+            unsigned phase = j->first % length;
+            for(unsigned n=0; n<length; ++n)
+            {
+                unsigned n_hits = whole + (n < rest);
+                if(n_hits) phases[phase].add_hits(j->second, n_hits);
+                if(++phase == length) phase = 0;
+            }
+        }
+
+        for(unsigned phase=0; phase<length; ++phase)
+        {
+            uint32 res = phases[phase].get();
+            if(AnimationBlurLength != 0 && res == most)
+            {
+                AveragePixel result;
+                result.set_n(res, 1);
+                for(unsigned n=1; n<=AnimationBlurLength; ++n)
+                {
+                    res = phases[(phase + length*AnimationBlurLength - n)
+                                 % length].get();
+                    result.set_n(res, 1);
+                    if(res != most) break;
+                }
+                res = result.get();
+            }
+            target[phase * target_stride] = res;
+        }
+    }
+
     template<typename SlaveType>
     uint32 GetFirstNAggregate(unsigned n) const
     {
@@ -332,6 +401,11 @@ public:
                     ++n_hits;
             result.set_n(pix, n_hits);
         }
+        void add_hits(uint32 pix, unsigned n_hits) FasterPixelMethod
+        {
+            if(pix == most) return;
+            result.set_n(pix, n_hits);
+        }
         inline uint32 get() const FasterPixelMethod
         {
             uint32 res = result.get();
@@ -353,6 +427,11 @@ public:
                 if(begin++ % LoopingLogLength == offs)
                     { result = pix; break; }
         }
+        void add_hits(uint32 pix, unsigned n_hits) FasterPixelMethod
+        {
+            if(pix == most) return;
+            if(n_hits) result = pix;
+        }
         inline uint32 get() const FasterPixelMethod
         {
             return result;
@@ -379,6 +458,10 @@ public:
     {
         return GetAggregate<LeastUsedPixel> ();
     }
+    inline uint32 GetTinyMostUsed(unsigned=0) const FastPixelMethod
+    {
+        return GetAggregate<TinyMostUsedPixel> ();
+    }
     inline uint32 GetAverage(unsigned=0) const FastPixelMethod
     {
         return GetAggregate<AveragePixel> ();
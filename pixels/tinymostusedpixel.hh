@@ -0,0 +1,63 @@
+/* TinyMostUsedPixel is a fixed-size approximation of MostUsedPixel.
+ * It tracks the heavy hitters with the Space-Saving algorithm:
+ * a color that is not being tracked replaces the least counted
+ * slot, inheriting its count. The counts always add up to the
+ * number of pixels seen, so a color seen in more than half of
+ * the frames has the only count above half and is always the
+ * result. Otherwise the inherited counts can make a color that
+ * arrived late win over the true most used color.
+ */
+class TinyMostUsedPixel
+{
+    static const unsigned NumSlots = 4;
+
+    uint32   values[NumSlots];
+    unsigned counts[NumSlots]; // 0 = unused slot
+public:
+    TinyMostUsedPixel()
+    {
+        for(unsigned a=0; a<NumSlots; ++a)
+            { values[a] = DefaultPixel; counts[a] = 0; }
+    }
+
+    void set(uint32 p, unsigned=0) FasterPixelMethod
+    {
+        set_n(p, 1);
+    }
+    void set_n(uint32 p, unsigned count) FastPixelMethod
+    {
+        if(!count) return;
+        unsigned smallest = 0;
+        for(unsigned a=0; a<NumSlots; ++a)
+        {
+            if(counts[a] && values[a] == p)
+            {
+                counts[a] += count;
+                return;
+            }
+            if(counts[a] < counts[smallest]) smallest = a;
+        }
+        values[smallest]  = p;
+        counts[smallest] += count;
+    }
+
+    inline uint32 get(unsigned=0) const FasterPixelMethod
+    {
+        return GetTinyMostUsed();
+    }
+
+    uint32 GetTinyMostUsed(unsigned=0) const FastPixelMethod
+    {
+        // Ties are resolved like in MostUsedPixel: smallest value wins
+        uint32 result = DefaultPixel;
+        unsigned best = 0;
+        for(unsigned a=0; a<NumSlots; ++a)
+            if(counts[a] > best
+            || (counts[a] == best && best && values[a] < result))
+                { result = values[a]; best = counts[a]; }
+        return result;
+    }
+
+/////////
+    static const unsigned SizePenalty = 0;
+};
@@ -130,6 +130,12 @@ anything that wanders around.
 Produced with commandline:<br>
 <code># animmerger -pm snaps/*.png -m0,8,256,16,020202,A64010,D09030,006E84,511800,FFFFFF<br>
 # mv tile-0000.png demo/method-m.png</code>
+<p>
+An approximate implementation of \"mostused\" is also provided: \"tinymostused\" (option -M).
+It uses a fixed amount of memory per pixel, regardless of how many
+different colors the pixel sees, which helps with noisy or dithered sources.
+A color seen in more than half of the frames is always chosen, but
+otherwise the result may differ from that of \"mostused\".
 
 ", 'last:1.1.1. LAST'=> "
 
@@ -470,6 +476,7 @@ Produced with commandline:<br>
  </tr><tr><th>&middot; LastUncommon</th>  <td>Static          </td>   <td>No</td>     <td>No       </td><td>As ChangeLog</td>                               <td></td>
  </tr><tr><th>&middot; LastNLeast</th>    <td>Static          </td>   <td>No</td>     <td>No       </td><td>As ChangeLog</td>                               <td></td>
  </tr><tr><th>MostUsed</th>               <td>Static          </td>   <td>No</td>     <td>No       </td><td>12&hellip;16 + 6&times;number of unique colors</td>   <td>Maps</td>
+ </tr><tr><th>TinyMostUsed</th>           <td>Static          </td>   <td>No</td>     <td>No       </td><td>32</td>                                         <td>Maps</td>
  </tr><tr><th>LeastUsed</th>              <td>Static          </td>   <td>No</td>     <td>No       </td><td>As MostUsed</td>                                <td></td>
  </tr><tr><th>Solid</th>                  <td>Static          </td>   <td>No</td>     <td>No       </td><td>12</td>                                         <td>Maps</td>
  </tr><tr><th>Average</th>                <td>Static          </td>   <td>Yes</td>    <td>Yes      </td><td>16</td>                                         <td></td>
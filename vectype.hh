@@ -67,6 +67,8 @@ public:
             destroy(&data[b.len], len-b.len);
             copy_assign(&data[0], &b.data[0], b.len);
         }
+        else
+            copy_assign(&data[0], &b.data[0], len);
         len = b.len;
         return *this;
     }